@@ -38,7 +38,8 @@ class AIStatefulTaskNamedMutex : public AIStatefulTaskMutex
 
  public:
   // Create a AIStatefulTaskNamedMutex that already has the file lock locked.
-  AIStatefulTaskNamedMutex(FileLockAccess const& file_lock_access) noexcept : m_file_lock_access(file_lock_access) { }
+  // The FileLockAccess is taken by value: pass an rvalue (std::move) to hand over the reference without touching the lock state.
+  AIStatefulTaskNamedMutex(FileLockAccess file_lock_access) noexcept : m_file_lock_access(std::move(file_lock_access)) { }
   // Create a AIStatefulTaskNamedMutex directly from a FileLock (this will try to lock the file lock if it isn't locked already).
   // Using a reference here because the FileLock that is passed should not be a temporary.
   AIStatefulTaskNamedMutex(FileLock& file_lock) : m_file_lock_access(file_lock) { }
@@ -52,9 +53,6 @@ class AIStatefulTaskNamedMutex : public AIStatefulTaskMutex
   friend class LockedBackEnd;
   AIStatefulTaskNamedMutex(LockedBackEnd*) : m_statefuL_task_lock(AIStatefulTaskLock::getInstance()) { }
 
-  // It's also ok for ScopedBlockingAIStatefulTaskNamedMutex, which is derived from AIStatefulTaskNamedMutex, to be constructed
-  // from just a FileLockAccess - because the constructor of ScopedBlockingAIStatefulTaskNamedMutex calls lock().
-  friend class ScopedBlockingAIStatefulTaskNamedMutex;
 #endif
 
 //  LockedBackEnd* operator->() const;
@@ -0,0 +1,141 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class AnyOfTaskLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "AnyOfTaskLock.h"
+#include <algorithm>
+
+namespace task {
+
+char const* AnyOfTaskLock::state_str_impl(state_type run_state) const
+{
+  switch (run_state)
+  {
+    AI_CASE_RETURN(AnyOfTaskLock_start);
+    AI_CASE_RETURN(AnyOfTaskLock_locked);
+  }
+  ASSERT(false);
+  return "UNKNOWN STATE";
+}
+
+void AnyOfTaskLock::multiplex_impl(state_type run_state)
+{
+  switch (run_state)
+  {
+    case AnyOfTaskLock_start:
+    {
+      // Pass at least one candidate.
+      ASSERT(!m_candidates.empty());
+      if (m_prefer_least_contended)
+      {
+        // Only queue on the least contended candidates. Take a snapshot of the contention first, as it can change at any moment.
+        std::vector<int> contention;
+        for (FileLockAccess const& candidate : m_candidates)
+          contention.push_back(candidate.task_contention());
+        int const min_contention = *std::min_element(contention.begin(), contention.end());
+        std::vector<FileLockAccess> least_contended;
+        for (size_t i = 0; i < m_candidates.size(); ++i)
+          if (contention[i] == min_contention)
+          {
+            least_contended.push_back(std::move(m_candidates[i]));
+            // If one of them is free, then there is no need to queue on more than one.
+            if (min_contention == 0)
+              break;
+          }
+        m_candidates = std::move(least_contended);
+      }
+      for (FileLockAccess& candidate : m_candidates)
+      {
+        m_task_locks.push_back(statefultask::create<TaskLock>(std::move(candidate)));
+        m_task_locks.back()->set_task_type("AnyOfTaskLock");
+      }
+      m_candidates.clear();
+      set_state(AnyOfTaskLock_locked);
+      // Wait until one of the children obtained its lock.
+      wait(1);
+      for (int index = 0; index < static_cast<int>(m_task_locks.size()); ++index)
+      {
+        TaskLock* task_lock = m_task_locks[index].get();
+        // Keep this task alive until the callback ran: it might be aborted (and released by its parent) at any moment.
+        task_lock->run([self = boost::intrusive_ptr<AnyOfTaskLock>(this), index, task_lock](bool success) mutable {
+          // Don't keep ourselves alive through the callback after it ran: it is owned by task_lock, which we own.
+          boost::intrusive_ptr<AnyOfTaskLock> const any_of_task_lock = std::move(self);
+          // We don't set a deadline: a child only aborts when it was cancelled.
+          if (!success)
+            return;
+          int expected = no_winner;
+          if (any_of_task_lock->m_winner.compare_exchange_strong(expected, index, std::memory_order_acq_rel))
+          {
+            // Remove the other children from their queues before they get a grant that they'd have to pass on.
+            any_of_task_lock->cancel_losers(index);
+            any_of_task_lock->signal(1);
+          }
+          else
+            task_lock->unlock();    // We lost (or the parent was aborted); pass the lock on.
+        });
+      }
+      break;
+    }
+    case AnyOfTaskLock_locked:
+      Dout(dc::notice, "AnyOfTaskLock: locked " << locked());
+      finish();
+      break;
+  }
+}
+
+void AnyOfTaskLock::cancel_losers(int winner)
+{
+  // Only the one that changed m_winner away from no_winner gets here; so nobody else accesses the losers.
+  for (int index = 0; index < static_cast<int>(m_task_locks.size()); ++index)
+    if (index != winner)
+    {
+      m_task_locks[index]->cancel();
+      // A cancelled child keeps itself alive until it finished; after that its FileLockAccess is released.
+      m_task_locks[index].reset();
+    }
+}
+
+void AnyOfTaskLock::abort_impl()
+{
+  DoutEntering(dc::statefultask, "AnyOfTaskLock::abort_impl() [" << this << "]");
+  // Make every child that still obtains its lock release it immediately.
+  int winner = m_winner.exchange(abandoned, std::memory_order_acq_rel);
+  if (winner == no_winner)
+  {
+    // Those that are still queued don't need to wait for that.
+    cancel_losers(no_winner);
+  }
+  else if (winner >= 0)
+  {
+    // The callback of the winner cancels the losers (if it didn't already);
+    // release the lock of the winner.
+    m_task_locks[winner]->unlock();
+  }
+}
+
+} // namespace task
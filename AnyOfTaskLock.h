@@ -0,0 +1,113 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class AnyOfTaskLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "TaskLock.h"
+#include <atomic>
+#include <vector>
+
+namespace task {
+
+// Lock any one of a number of interchangeable FileLocks: whichever is granted first.
+//
+// A TaskLock child is run for every candidate. The first one that obtains its lock wins;
+// every other child is cancelled (see TaskLock::cancel): it is removed from the waiter queue
+// of its file lock, or - if it was granted its lock in the meantime - releases it immediately.
+// The FileLockAccess objects of the losers are released as soon as the winner is known.
+//
+// Every child holds a reference to the AnyOfTaskLock until its callback ran, so that
+// the AnyOfTaskLock is not destroyed before all of its children finished.
+//
+// If prefer_least_contended is set then only the candidates with the smallest number of
+// tasks that own or wait for them (see FileLockAccess::task_contention) are queued on.
+//
+// Usage:
+//
+//   auto any_of_task_lock = statefultask::create<task::AnyOfTaskLock>(std::move(scratch_disks));
+//   any_of_task_lock->run(...);
+//   ...
+//   // Once finished:
+//   FileLockAccess const& scratch_disk = any_of_task_lock->locked();
+//   ...
+//   any_of_task_lock->unlock();
+//
+class AnyOfTaskLock : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum any_of_task_lock_state_type {
+    AnyOfTaskLock_start = direct_base_type::state_end,      // The first state.
+    AnyOfTaskLock_locked
+  };
+
+ private:
+  // Special values of m_winner.
+  static constexpr int no_winner = -1;                      // None of the children obtained its lock yet.
+  static constexpr int abandoned = -2;                      // This task was aborted; every child must release its lock as soon as it gets it.
+
+  std::vector<FileLockAccess> m_candidates;                 // The candidates; moved into m_task_locks once we start.
+  bool const m_prefer_least_contended;
+  std::vector<boost::intrusive_ptr<TaskLock>> m_task_locks; // One TaskLock per candidate that we are queued on; only that of the winner is kept.
+  std::atomic<int> m_winner;                                // Index into m_task_locks of the child that won, or one of the special values above.
+
+ public:
+  AnyOfTaskLock(std::vector<FileLockAccess> candidates, bool prefer_least_contended = false) :
+    AIStatefulTask(CWDEBUG_ONLY(true)), m_candidates(std::move(candidates)), m_prefer_least_contended(prefer_least_contended),
+    m_winner(no_winner) {
+      DoutEntering(dc::statefultask, "AnyOfTaskLock(" << m_candidates.size() << " candidates, " << prefer_least_contended << ") [" << this << "]"); }
+
+  ~AnyOfTaskLock() { DoutEntering(dc::statefultask, "~AnyOfTaskLock() [" << this << "]"); }
+
+  static state_type constexpr state_end = AnyOfTaskLock_locked + 1;
+
+  // The candidate that was locked. Only call this after the task finished successfully.
+  FileLockAccess const& locked() const
+  {
+    int winner = m_winner.load(std::memory_order_acquire);
+    ASSERT(winner >= 0);
+    return m_task_locks[winner]->file_lock_access();
+  }
+
+  void unlock()
+  {
+    int winner = m_winner.load(std::memory_order_acquire);
+    ASSERT(winner >= 0);
+    m_task_locks[winner]->unlock();
+  }
+
+ private:
+  char const* task_name_impl() const override { return "AnyOfTaskLock"; }
+  char const* state_str_impl(state_type run_state) const final override;
+  void multiplex_impl(state_type run_state) final override;
+  void abort_impl() override;
+  void cancel_losers(int winner);
+};
+
+} // namespace task
@@ -0,0 +1,87 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class AsyncFileLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "AsyncFileLock.h"
+#include "utils/AIAlert.h"
+#include <memory>
+
+std::future<AsyncFileLock> acquire_async(FileLock& file_lock)
+{
+  std::promise<AsyncFileLock> promise;
+  std::future<AsyncFileLock> future = promise.get_future();
+  boost::intrusive_ptr<task::TaskLock> task_lock;
+  try
+  {
+    // This obtains the file lock, or throws.
+    task_lock = statefultask::create<task::TaskLock>(FileLockAccess(file_lock));
+  }
+  catch (AIAlert::Error const&)
+  {
+    promise.set_exception(std::current_exception());
+    return future;
+  }
+  return acquire_async(std::move(task_lock));
+}
+
+std::future<AsyncFileLock> acquire_async(boost::intrusive_ptr<task::TaskLock> task_lock)
+{
+  DoutEntering(dc::notice, "acquire_async(" << task_lock.get() << ")");
+  // The promise must be shared because the callback of a task must be copyable.
+  auto promise = std::make_shared<std::promise<AsyncFileLock>>();
+  std::future<AsyncFileLock> future = promise->get_future();
+  task_lock->set_task_type("acquire_async");
+
+  // Run the task with the immediate handler: it either obtains the lock right away (in this thread),
+  // or it is woken up by (and continues in) the thread that releases the lock before us.
+  // Capture a raw pointer: a running task keeps itself alive.
+  task::TaskLock* task_lock_ptr = task_lock.get();
+  task_lock_ptr->run([promise, task_lock_ptr](bool success) mutable {
+    // The shared state of the promise will own the TaskLock (through AsyncFileLock), which owns this callback:
+    // move the promise out of the callback, or that cycle would keep both alive when the future is never used.
+    std::shared_ptr<std::promise<AsyncFileLock>> const promise_ptr = std::move(promise);
+    if (success)
+    {
+      promise_ptr->set_value(AsyncFileLock(task_lock_ptr));
+      return;
+    }
+    try
+    {
+      if (task_lock_ptr->deadline_missed())
+        THROW_ALERT("Failed to obtain file lock [FILENAME]: the deadline was missed.", AIArgs("[FILENAME]", task_lock_ptr->file_lock_access().canonical_path()));
+      if (task_lock_ptr->rejected())
+        THROW_ALERT("Failed to obtain file lock [FILENAME]: the queue is saturated.", AIArgs("[FILENAME]", task_lock_ptr->file_lock_access().canonical_path()));
+      THROW_ALERT("Failed to obtain file lock [FILENAME]: the request was aborted.", AIArgs("[FILENAME]", task_lock_ptr->file_lock_access().canonical_path()));
+    }
+    catch (AIAlert::Error const&)
+    {
+      promise_ptr->set_exception(std::current_exception());
+    }
+  });
+
+  return future;
+}
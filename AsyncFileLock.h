@@ -0,0 +1,93 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class AsyncFileLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "TaskLock.h"
+#include <future>
+
+class FileLock;
+
+// A lock that was obtained with acquire_async.
+//
+// Holds the task mutex of the file lock (and therefore also the file lock itself) until it is
+// destroyed, or until unlock() is called; after which owns_lock() returns false.
+//
+class AsyncFileLock
+{
+ private:
+  boost::intrusive_ptr<task::TaskLock> m_task_lock;     // The task that owns the lock, or nullptr when not owning the lock.
+
+ public:
+  AsyncFileLock() = default;
+  explicit AsyncFileLock(boost::intrusive_ptr<task::TaskLock> task_lock) : m_task_lock(std::move(task_lock)) { }
+  AsyncFileLock(AsyncFileLock&& async_file_lock) noexcept = default;
+  AsyncFileLock& operator=(AsyncFileLock&& async_file_lock) noexcept
+  {
+    unlock();
+    m_task_lock = std::move(async_file_lock.m_task_lock);
+    return *this;
+  }
+  ~AsyncFileLock() { unlock(); }
+
+  // Return true while the lock is held.
+  bool owns_lock() const { return static_cast<bool>(m_task_lock); }
+
+  // Release the lock early. Does nothing when the lock isn't held.
+  void unlock()
+  {
+    if (m_task_lock)
+    {
+      // Use abandon(): this can be called from the destructor of a std::future's shared state, at any moment.
+      m_task_lock->abandon();
+      m_task_lock.reset();
+    }
+  }
+};
+
+// Obtain a lock from code that doesn't run a task, without blocking the calling thread.
+//
+// The returned future becomes ready when the task mutex of the file lock is obtained (the file lock
+// itself is obtained right away, or the future holds the AIAlert::Error that would have been thrown
+// by FileLockAccess). Internally task_lock is run with the immediate handler, so non-task callers
+// wait in the same waiter queue as tasks: with the same fairness, groups, deadlines and admission
+// control. If task_lock aborts (it missed its deadline, it was rejected, or it was aborted otherwise)
+// then the future holds an AIAlert::Error too, that says which of these happened.
+//
+// Usage:
+//
+//   std::future<AsyncFileLock> future = acquire_async(file_lock);
+//   // ... do other things ...
+//   AsyncFileLock lock = future.get();
+//   // ... access the resource protected by file_lock ...
+//
+// Use the second overload to configure the TaskLock first (see TaskLock::set_group, set_deadline
+// and set_fail_fast). Do not wait for the future from a task: that would block a thread of the
+// thread pool.
+//
+std::future<AsyncFileLock> acquire_async(FileLock& file_lock);
+std::future<AsyncFileLock> acquire_async(boost::intrusive_ptr<task::TaskLock> task_lock);
@@ -0,0 +1,105 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class DeadlineTimer.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "DeadlineTimer.h"
+#include "FileLockQueue.h"
+#include "debug.h"
+
+//static
+DeadlineTimer& DeadlineTimer::instance()
+{
+  // Never destroyed: queues of global FileLock objects might be destructed after it otherwise.
+  static DeadlineTimer* s_instance = new DeadlineTimer;
+  return *s_instance;
+}
+
+void DeadlineTimer::erase(FileLockQueue* queue)
+{
+  auto armed = m_armed.find(queue);
+  if (armed == m_armed.end())
+    return;
+  m_deadlines.erase({armed->second, queue});
+  m_armed.erase(armed);
+}
+
+void DeadlineTimer::arm(FileLockQueue* queue, clock_type::time_point deadline)
+{
+  std::lock_guard<std::mutex> lock(m_mutex);
+  erase(queue);
+  if (deadline == clock_type::time_point::max())
+    return;
+  if (!m_thread.joinable())
+    m_thread = std::thread(&DeadlineTimer::main, this);
+  m_deadlines.emplace(deadline, queue);
+  m_armed.emplace(queue, deadline);
+  // Wake up the thread if this is now the earliest deadline.
+  if (m_deadlines.begin()->second == queue)
+    m_condition.notify_all();
+}
+
+void DeadlineTimer::disarm(FileLockQueue* queue)
+{
+  std::unique_lock<std::mutex> lock(m_mutex);
+  erase(queue);
+  // The queue can be destroyed from expire() itself (a dropped task that is run immediately might release
+  // the last reference to its file lock); expire() no longer uses the queue then.
+  if (std::this_thread::get_id() != m_thread.get_id())
+    m_condition.wait(lock, [this, queue](){ return m_expiring != queue; });
+}
+
+void DeadlineTimer::main()
+{
+  Debug(NAMESPACE_DEBUG::init_thread("DeadlineTimer"));
+  std::unique_lock<std::mutex> lock(m_mutex);
+  for (;;)
+  {
+    if (m_deadlines.empty())
+    {
+      m_condition.wait(lock);
+      continue;
+    }
+    auto earliest = m_deadlines.begin();
+    if (earliest->first > clock_type::now())
+    {
+      // Copy the deadline: wait_until uses it after relocking, when arm() might have erased the element.
+      clock_type::time_point const deadline = earliest->first;
+      m_condition.wait_until(lock, deadline);
+      continue;
+    }
+    FileLockQueue* queue = earliest->second;
+    m_armed.erase(queue);
+    m_deadlines.erase(earliest);
+    m_expiring = queue;
+    lock.unlock();
+    // This arms the next deadline of queue, if any.
+    queue->expire();
+    lock.lock();
+    m_expiring = nullptr;
+    m_condition.notify_all();
+  }
+}
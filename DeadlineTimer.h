@@ -0,0 +1,78 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class DeadlineTimer.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+
+class FileLockQueue;
+
+// class DeadlineTimer
+//
+// Calls FileLockQueue::expire when the earliest deadline of a waiter of that queue passes,
+// so that expired waiters are dropped on time, also when nothing else happens to the queue.
+//
+// Every queue arms at most one deadline (that of its most urgent waiter). They are all handled by
+// a single thread, which is started when the first deadline is armed.
+//
+class DeadlineTimer
+{
+ public:
+  using clock_type = std::chrono::steady_clock;
+
+ private:
+  std::mutex m_mutex;
+  std::condition_variable m_condition;                              // Notified when an earlier deadline is armed, and when expire() returns.
+  std::set<std::pair<clock_type::time_point, FileLockQueue*>> m_deadlines;      // The armed deadlines, earliest first.
+  std::map<FileLockQueue*, clock_type::time_point> m_armed;        // The armed deadline of each queue.
+  FileLockQueue* m_expiring = nullptr;                              // The queue whose expire() is being called, if any.
+  std::thread m_thread;
+
+  DeadlineTimer() = default;
+
+ public:
+  // Return the process-wide instance.
+  static DeadlineTimer& instance();
+
+  // Call queue->expire() at deadline; replaces the deadline that queue armed before.
+  // If deadline is clock_type::time_point::max() then the deadline of queue is just removed.
+  void arm(FileLockQueue* queue, clock_type::time_point deadline);
+
+  // Remove the deadline of queue, and wait until a running queue->expire() returned (unless called from it).
+  // Must be called before queue is destroyed.
+  void disarm(FileLockQueue* queue);
+
+ private:
+  void main();
+  void erase(FileLockQueue* queue);
+};
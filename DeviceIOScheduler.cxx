@@ -0,0 +1,124 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class DeviceIOScheduler.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "DeviceIOScheduler.h"
+
+void DeviceIOScheduler::submit(AIStatefulTask* task, AIStatefulTask::condition_type condition, off_t offset, work_type work)
+{
+  bool start_batch;
+  {
+    Data_ts::wat data_w(m_data);
+    data_w->m_pending.emplace(offset, Request{std::move(work), task, condition});
+    start_batch = !data_w->m_batch_running;
+    data_w->m_batch_running = true;
+  }
+  // A running task keeps itself alive until it finished.
+  if (start_batch)
+    statefultask::create<task::DeviceIOBatch>(this)->run();
+}
+
+std::vector<DeviceIOScheduler::Request> DeviceIOScheduler::next_batch()
+{
+  std::vector<Request> batch;
+  Data_ts::wat data_w(m_data);
+  auto& pending = data_w->m_pending;
+  // Continue the sweep where the previous batch left off.
+  auto request = pending.lower_bound(data_w->m_head_position);
+  while (!pending.empty() && batch.size() < m_max_batch)
+  {
+    // Wrap around to the lowest offset when reaching the end.
+    if (request == pending.end())
+      request = pending.begin();
+    data_w->m_head_position = request->first;
+    batch.push_back(std::move(request->second));
+    request = pending.erase(request);
+  }
+  return batch;
+}
+
+bool DeviceIOScheduler::continue_batches()
+{
+  Data_ts::wat data_w(m_data);
+  if (data_w->m_pending.empty())
+  {
+    data_w->m_batch_running = false;
+    return false;
+  }
+  return true;
+}
+
+namespace task {
+
+char const* DeviceIOBatch::state_str_impl(state_type run_state) const
+{
+  switch (run_state)
+  {
+    AI_CASE_RETURN(DeviceIOBatch_lock);
+    AI_CASE_RETURN(DeviceIOBatch_locked);
+  }
+  ASSERT(false);
+  return "UNKNOWN STATE";
+}
+
+void DeviceIOBatch::multiplex_impl(state_type run_state)
+{
+  switch (run_state)
+  {
+    case DeviceIOBatch_lock:
+      m_task_lock = statefultask::create<TaskLock>(m_scheduler->m_device_access);
+      m_task_lock->set_task_type("DeviceIOBatch");
+      set_state(DeviceIOBatch_locked);
+      m_task_lock->run(this, 1);
+      wait(1);
+      break;
+    case DeviceIOBatch_locked:
+    {
+      auto batch = m_scheduler->next_batch();
+      Dout(dc::notice, "DeviceIOBatch: executing " << batch.size() << " requests.");
+      for (auto& request : batch)
+      {
+        request.m_work();
+        request.m_task->signal(request.m_condition);
+      }
+      // End this lock tenure, giving other users of the device lock a turn.
+      m_task_lock->unlock();
+      m_task_lock.reset();
+      if (m_scheduler->continue_batches())
+      {
+        set_state(DeviceIOBatch_lock);
+        yield();
+        break;
+      }
+      finish();
+      break;
+    }
+  }
+}
+
+} // namespace task
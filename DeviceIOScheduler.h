@@ -0,0 +1,140 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class DeviceIOScheduler.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "TaskLock.h"
+#include <functional>
+#include <map>
+#include <vector>
+#include <sys/types.h>
+
+class DeviceIOScheduler;
+
+namespace task {
+
+// The task that performs the I/O of a DeviceIOScheduler: it obtains the device lock with a TaskLock,
+// executes a batch of requests in offset order while holding it, releases it and repeats until no
+// more requests are pending. There is at most one DeviceIOBatch running per DeviceIOScheduler.
+class DeviceIOBatch : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum device_io_batch_state_type {
+    DeviceIOBatch_lock = direct_base_type::state_end,   // The first state.
+    DeviceIOBatch_locked
+  };
+
+ private:
+  DeviceIOScheduler* m_scheduler;
+  boost::intrusive_ptr<TaskLock> m_task_lock;           // The TaskLock of the current lock tenure.
+
+ public:
+  DeviceIOBatch(DeviceIOScheduler* scheduler) : AIStatefulTask(CWDEBUG_ONLY(true)), m_scheduler(scheduler) {
+      DoutEntering(dc::statefultask, "DeviceIOBatch(" << scheduler << ") [" << this << "]"); }
+
+  ~DeviceIOBatch() { DoutEntering(dc::statefultask, "~DeviceIOBatch() [" << this << "]"); }
+
+  static state_type constexpr state_end = DeviceIOBatch_locked + 1;
+
+ private:
+  char const* task_name_impl() const override { return "DeviceIOBatch"; }
+  char const* state_str_impl(state_type run_state) const final override;
+  void multiplex_impl(state_type run_state) final override;
+};
+
+} // namespace task
+
+// class DeviceIOScheduler
+//
+// Reorders disk work that is queued behind a device FileLock (see DeviceLock) by file offset.
+//
+// Instead of every task obtaining the device lock for its own request, tasks submit their
+// request together with the offset that it accesses. Pending requests are served by a single
+// DeviceIOBatch task that, during one lock tenure, executes up to max_batch of them in
+// ascending offset order, starting at the offset where the previous batch left off and
+// wrapping around (C-SCAN elevator). Adjacent requests are therefore executed together
+// and the disk head sweeps in one direction instead of seeking back and forth.
+//
+// The device lock itself is obtained through a TaskLock, so the batches take their turn
+// in the queue of the FileLockSingleton with any other task (or process) that uses it.
+//
+// Usage (from a task):
+//
+//   scheduler.submit(this, condition, offset, [&](){ /* read or write at offset */ });
+//   wait(condition);   // Woken up once the work was executed.
+//
+// The work is executed by the DeviceIOBatch task, while holding the device lock; it should
+// not block on anything but the disk access itself.
+//
+class DeviceIOScheduler
+{
+ public:
+  using work_type = std::function<void()>;
+
+ private:
+  struct Request
+  {
+    work_type m_work;                                   // The work to execute while holding the lock.
+    AIStatefulTask* m_task;                             // The task to signal once the work was executed.
+    AIStatefulTask::condition_type m_condition;         // The condition to signal m_task with.
+  };
+
+  struct Data
+  {
+    std::multimap<off_t, Request> m_pending;            // Requests that were not executed yet, by offset.
+    off_t m_head_position;                              // The offset of the last executed request.
+    bool m_batch_running;                               // Set while a DeviceIOBatch task is running.
+
+    Data() : m_head_position(0), m_batch_running(false) { }
+  };
+  using Data_ts = threadsafe::Unlocked<Data, threadsafe::policy::Primitive<std::mutex>>;
+
+  FileLockAccess const m_device_access;                 // Access to the device lock.
+  size_t const m_max_batch;                             // The maximum number of requests to execute per lock tenure.
+  Data_ts m_data;
+
+ public:
+  // The scheduler must outlive all requests submitted to it.
+  DeviceIOScheduler(FileLockAccess device_access, size_t max_batch = 64) : m_device_access(std::move(device_access)), m_max_batch(max_batch)
+  {
+    // A batch must make progress.
+    ASSERT(max_batch > 0);
+  }
+
+  // Queue work that accesses the device at offset; task will be signalled with condition once it was executed.
+  void submit(AIStatefulTask* task, AIStatefulTask::condition_type condition, off_t offset, work_type work);
+
+ private:
+  friend class task::DeviceIOBatch;
+  // Remove and return the next batch of pending requests in elevator order.
+  std::vector<Request> next_batch();
+  // Return true if more requests are pending; otherwise the DeviceIOBatch task must finish.
+  bool continue_batches();
+};
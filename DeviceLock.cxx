@@ -0,0 +1,161 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class DeviceLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "DeviceLock.h"
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+//static
+DeviceLock::Data_ts DeviceLock::s_data;
+
+//static
+void DeviceLock::set_lock_directory(std::filesystem::path const& lock_directory)
+{
+  Data_ts::wat data_w(s_data);
+  // Set the lock directory before creating the first device lock.
+  ASSERT(data_w->m_device_locks.empty());
+  data_w->m_lock_directory = lock_directory;
+}
+
+//static
+dev_t DeviceLock::block_device(std::filesystem::path const& data_path)
+{
+  struct stat statbuf;
+  if (stat(data_path.c_str(), &statbuf) == -1)
+    THROW_ALERTE("stat([PATH])", AIArgs("[PATH]", data_path));
+  dev_t device = statbuf.st_dev;
+
+  // If this is a partition, then /sys/dev/block/MAJOR:MINOR links to a directory that contains
+  // a file 'partition' and whose parent directory is the whole disk.
+  std::filesystem::path const sysfs_link = "/sys/dev/block/" + std::to_string(major(device)) + ':' + std::to_string(minor(device));
+  std::error_code error_code;
+  std::filesystem::path const sysfs_device = std::filesystem::canonical(sysfs_link, error_code);
+  if (error_code)       // Not a block device (tmpfs, NFS, ...) or no sysfs.
+    return device;
+  if (std::filesystem::exists(sysfs_device / "partition", error_code))
+  {
+    std::ifstream dev_file(sysfs_device.parent_path() / "dev");
+    unsigned int disk_major, disk_minor;
+    char colon;
+    if (dev_file >> disk_major >> colon >> disk_minor && colon == ':')
+      device = makedev(disk_major, disk_minor);
+    else
+      Dout(dc::warning, "Could not read " << (sysfs_device.parent_path() / "dev") << "; using the partition as device.");
+  }
+  return device;
+}
+
+//static
+bool DeviceLock::is_rotational(dev_t device)
+{
+  std::ifstream rotational_file("/sys/dev/block/" + std::to_string(major(device)) + ':' + std::to_string(minor(device)) + "/queue/rotational");
+  int rotational;
+  if (!(rotational_file >> rotational))
+  {
+    Dout(dc::warning, "Could not determine if device " << major(device) << ':' << minor(device) << " is rotational; assuming it is.");
+    return true;
+  }
+  return rotational != 0;
+}
+
+//static
+std::filesystem::path DeviceLock::lock_filename(Data& data, dev_t device)
+{
+  if (data.m_lock_directory.empty())
+    data.m_lock_directory = std::filesystem::temp_directory_path();
+  return data.m_lock_directory / ("device-" + std::to_string(major(device)) + '-' + std::to_string(minor(device)) + ".lock");
+}
+
+//static
+void DeviceLock::set_concurrency(std::filesystem::path const& data_path, int concurrency)
+{
+  ASSERT(concurrency > 0);
+  dev_t const device = block_device(data_path);
+  Data_ts::wat data_w(s_data);
+  // Set the concurrency before the first call to get_semaphore for this device.
+  ASSERT(data_w->m_device_semaphores.find(device) == data_w->m_device_semaphores.end());
+  data_w->m_concurrency[device] = concurrency;
+}
+
+//static
+void DeviceLock::set_non_rotational_concurrency(int concurrency)
+{
+  ASSERT(concurrency > 0);
+  Data_ts::wat(s_data)->m_non_rotational_concurrency = concurrency;
+}
+
+//static
+SemaphoreLock& DeviceLock::get_semaphore(std::filesystem::path const& data_path)
+{
+  dev_t const device = block_device(data_path);
+  Data_ts::wat data_w(s_data);
+  auto& device_semaphore = data_w->m_device_semaphores[device];
+  if (!device_semaphore)
+  {
+    auto concurrency_iter = data_w->m_concurrency.find(device);
+    int const concurrency =
+      concurrency_iter != data_w->m_concurrency.end() ? concurrency_iter->second :
+      is_rotational(device) ? 1 : data_w->m_non_rotational_concurrency;
+    try
+    {
+      device_semaphore = new SemaphoreLock(lock_filename(*data_w, device), concurrency);
+    }
+    catch (...)
+    {
+      data_w->m_device_semaphores.erase(device);
+      throw;
+    }
+    Dout(dc::notice, "DeviceLock: " << data_path << " is on device " << major(device) << ':' << minor(device) << " with concurrency " << concurrency << ".");
+  }
+  return *device_semaphore;
+}
+
+//static
+FileLock& DeviceLock::get(std::filesystem::path const& data_path)
+{
+  dev_t const device = block_device(data_path);
+  Data_ts::wat data_w(s_data);
+  auto& device_lock = data_w->m_device_locks[device];
+  if (!device_lock)
+  {
+    try
+    {
+      device_lock = new FileLock(lock_filename(*data_w, device));
+    }
+    catch (...)
+    {
+      data_w->m_device_locks.erase(device);
+      throw;
+    }
+    Dout(dc::notice, "DeviceLock: " << data_path << " is on device " << major(device) << ':' << minor(device) << ".");
+  }
+  return *device_lock;
+}
@@ -0,0 +1,100 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class DeviceLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "FileLock.h"
+#include "SemaphoreLock.h"
+#include <map>
+#include <sys/types.h>
+
+// class DeviceLock
+//
+// Maps arbitrary data paths to one FileLock per (whole disk) block device.
+//
+// Tasks that access files on the same spindle should serialize, while tasks that access
+// files on different devices can run in parallel. Rather than inventing a lock path per
+// disk by hand, pass the path of the data that will be accessed to DeviceLock::get:
+// the device of that path is determined with stat(2), and if it is a partition, it is
+// replaced by the whole disk that contains it (using /sys/dev/block). The returned FileLock
+// has the lock file "device-MAJOR-MINOR.lock" in the lock directory.
+//
+// The FileLock objects are owned by DeviceLock and live until the end of the program,
+// so they satisfy the lifetime requirements of FileLock. They are intentionally never
+// destructed: at exit, the objects that they use might already have been destroyed.
+//
+// Usage:
+//
+//   DeviceLock::set_lock_directory("/var/lock/myapp");         // Optional; all processes must use the same directory.
+//   FileLockAccess disk_access(DeviceLock::get(data_path));
+//
+// Alternatively, get_semaphore returns a SemaphoreLock for the device that allows one user
+// for a rotational disk (same lock file as get) and non_rotational_concurrency users for
+// anything else (as reported by /sys/dev/block/MAJOR:MINOR/queue/rotational), unless the
+// concurrency of the device was set explicitly with set_concurrency.
+//
+class DeviceLock
+{
+ private:
+  struct Data
+  {
+    std::filesystem::path m_lock_directory;                     // The directory in which the device lock files are created.
+    std::map<dev_t, FileLock*> m_device_locks;                  // The FileLock for each device, by device id.
+    std::map<dev_t, SemaphoreLock*> m_device_semaphores;        // The SemaphoreLock for each device, by device id.
+    std::map<dev_t, int> m_concurrency;                         // Explicitly set concurrency, by device id.
+    int m_non_rotational_concurrency = 4;                       // The concurrency used for non-rotational devices.
+  };
+  using Data_ts = threadsafe::Unlocked<Data, threadsafe::policy::Primitive<std::mutex>>;
+  static Data_ts s_data;
+
+ public:
+  // Set the directory to create the lock files in. The default is std::filesystem::temp_directory_path().
+  // Call this before the first call to get().
+  static void set_lock_directory(std::filesystem::path const& lock_directory);
+
+  // Return the FileLock of the device that data_path is stored on.
+  static FileLock& get(std::filesystem::path const& data_path);
+
+  // Set the concurrency of the device that data_path is stored on. Call this before the first call to get_semaphore for that device.
+  static void set_concurrency(std::filesystem::path const& data_path, int concurrency);
+
+  // Set the concurrency that is used for non-rotational devices whose concurrency wasn't set explicitly.
+  static void set_non_rotational_concurrency(int concurrency);
+
+  // Return the SemaphoreLock of the device that data_path is stored on.
+  static SemaphoreLock& get_semaphore(std::filesystem::path const& data_path);
+
+  // Return the device id of the whole disk that data_path is stored on, or just its st_dev if that can not be determined.
+  static dev_t block_device(std::filesystem::path const& data_path);
+
+  // Return true if the device is a rotational disk (or if that can not be determined).
+  static bool is_rotational(dev_t device);
+
+ private:
+  static std::filesystem::path lock_filename(Data& data, dev_t device);
+};
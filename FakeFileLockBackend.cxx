@@ -0,0 +1,193 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class FakeFileLockBackend.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FakeFileLockBackend.h"
+#include "utils/AIAlert.h"
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+void FakeFileSystem::simulate_latency() const
+{
+  std::chrono::nanoseconds latency(m_latency.load(std::memory_order_relaxed));
+  if (latency.count() > 0)
+    std::this_thread::sleep_for(latency);
+}
+
+std::shared_ptr<FakeFileSystem::Inode> FakeFileSystem::create(Data_ts::wat const& data_w, std::filesystem::path const& path)
+{
+  auto& inode = data_w->m_directory_entries[path];
+  if (!inode)
+    inode = std::make_shared<Inode>(++data_w->m_last_inode_number);
+  return inode;
+}
+
+void FakeFileSystem::create(std::filesystem::path const& path)
+{
+  create(Data_ts::wat(m_data), path);
+}
+
+bool FakeFileSystem::link(std::filesystem::path const& existing_path, std::filesystem::path const& new_path)
+{
+  Data_ts::wat data_w(m_data);
+  auto existing = data_w->m_directory_entries.find(existing_path);
+  if (existing == data_w->m_directory_entries.end())
+    return false;
+  data_w->m_directory_entries[new_path] = existing->second;
+  return true;
+}
+
+void FakeFileSystem::remove(std::filesystem::path const& path)
+{
+  Data_ts::wat(m_data)->m_directory_entries.erase(path);
+}
+
+int FakeFileSystem::lock_owner(std::filesystem::path const& path) const
+{
+  Data_ts::crat data_r(m_data);
+  auto entry = data_r->m_directory_entries.find(path);
+  return entry == data_r->m_directory_entries.end() ? 0 : entry->second->m_lock_owner;
+}
+
+class FakeFileLockBackend::FakeLockFile : public FileLockBackend::LockFile
+{
+ private:
+  std::shared_ptr<FakeFileSystem> m_file_system_ptr;
+  FakeFileSystem& m_file_system;
+  std::shared_ptr<FakeFileSystem::Inode> m_inode;       // Accessed while holding m_file_system.m_data.
+  int const m_process_id;
+
+ public:
+  FakeLockFile(std::shared_ptr<FakeFileSystem> file_system, std::shared_ptr<FakeFileSystem::Inode> inode, int process_id) :
+    m_file_system_ptr(std::move(file_system)), m_file_system(*m_file_system_ptr), m_inode(std::move(inode)), m_process_id(process_id) { }
+
+  inode_id_type inode_id() const override
+  {
+    return inode_id_type{FakeFileSystem::device, m_inode->m_number};
+  }
+
+  ~FakeLockFile()
+  {
+    // Like on POSIX, closing the file releases the file lock.
+    FakeFileSystem::Data_ts::wat data_w(m_file_system.m_data);
+    if (m_inode->m_lock_owner == m_process_id)
+      m_inode->m_lock_owner = 0;
+  }
+
+  bool try_lock() override
+  {
+    m_file_system.simulate_latency();
+    FakeFileSystem::Data_ts::wat data_w(m_file_system.m_data);
+    if (m_inode->m_lock_owner == 0)
+      m_inode->m_lock_owner = m_process_id;
+    return m_inode->m_lock_owner == m_process_id;
+  }
+
+  bool test_lock(pid_t& holder) override
+  {
+    m_file_system.simulate_latency();
+    FakeFileSystem::Data_ts::wat data_w(m_file_system.m_data);
+    if (m_inode->m_lock_owner == 0 || m_inode->m_lock_owner == m_process_id)
+      return false;
+    holder = m_inode->m_lock_owner;     // The simulated process id.
+    return true;
+  }
+
+  void unlock() override
+  {
+    m_file_system.simulate_latency();
+    FakeFileSystem::Data_ts::wat data_w(m_file_system.m_data);
+    // Only unlock what we locked.
+    ASSERT(m_inode->m_lock_owner == m_process_id);
+    m_inode->m_lock_owner = 0;
+  }
+
+  size_t read(void* buffer, size_t size) override
+  {
+    m_file_system.simulate_latency();
+    FakeFileSystem::Data_ts::wat data_w(m_file_system.m_data);
+    size_t len = std::min(size, m_inode->m_contents.size());
+    if (len > 0)        // The contents of an empty file might not have storage.
+      std::memcpy(buffer, m_inode->m_contents.data(), len);
+    return len;
+  }
+
+  bool write(void const* buffer, size_t size) override
+  {
+    m_file_system.simulate_latency();
+    FakeFileSystem::Data_ts::wat data_w(m_file_system.m_data);
+    ASSERT(m_inode->m_lock_owner == m_process_id);
+    if (m_inode->m_contents.size() < size)
+    {
+      // The mapped contents can't be moved.
+      if (m_inode->m_mapped)
+        return false;
+      m_inode->m_contents.resize(size);
+    }
+    std::memcpy(m_inode->m_contents.data(), buffer, size);
+    return true;
+  }
+
+  void* map(size_t size) override
+  {
+    m_file_system.simulate_latency();
+    FakeFileSystem::Data_ts::wat data_w(m_file_system.m_data);
+    if (m_inode->m_contents.size() < size)
+    {
+      // Every process must map the same size (the fake can't move memory that was already handed out).
+      if (m_inode->m_mapped)
+        THROW_ALERT("Can not extend the mapped fake lock file to [SIZE] bytes.", AIArgs("[SIZE]", size));
+      m_inode->m_contents.resize(size);
+    }
+    m_inode->m_mapped = true;
+    return m_inode->m_contents.data();
+  }
+
+  void unmap(void*, size_t) override
+  {
+    // The contents stay mapped for as long as the inode exists.
+  }
+};
+
+std::unique_ptr<FileLockBackend::LockFile> FakeFileLockBackend::open(std::filesystem::path const& path)
+{
+  m_file_system->simulate_latency();
+  std::shared_ptr<FakeFileSystem::Inode> inode = m_file_system->create(FakeFileSystem::Data_ts::wat(m_file_system->m_data), path);
+  return std::make_unique<FakeLockFile>(m_file_system, std::move(inode), m_process_id);
+}
+
+bool FakeFileLockBackend::stat(std::filesystem::path const& path, inode_id_type& inode_id)
+{
+  m_file_system->simulate_latency();
+  FakeFileSystem::Data_ts::crat data_r(m_file_system->m_data);
+  auto entry = data_r->m_directory_entries.find(path);
+  if (entry == data_r->m_directory_entries.end())
+    return false;
+  inode_id = inode_id_type{FakeFileSystem::device, entry->second->m_number};
+  return true;
+}
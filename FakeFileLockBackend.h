@@ -0,0 +1,125 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class FakeFileLockBackend.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "FileLockBackend.h"
+#include "threadsafe/threadsafe.h"
+#include "debug.h"
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// class FakeFileSystem
+//
+// A deterministic, in-memory file system for lock files: paths map to (simulated) inodes that
+// have contents and a file lock owner. Equivalent paths can be created with link().
+//
+// A FakeFileSystem is shared by any number of FakeFileLockBackend objects, each of which represents
+// a different process. For example,
+//
+//   auto file_system = std::make_shared<FakeFileSystem>();
+//   file_system->set_latency(std::chrono::microseconds(50));
+//   FileLock::set_backend(std::make_shared<FakeFileLockBackend>(file_system, 1));
+//   FakeFileLockBackend other_process(file_system, 2);      // Can be used to hold locks "from another process".
+//
+class FakeFileSystem
+{
+ public:
+  static constexpr dev_t device = 0xfa4e;                       // The st_dev of all fake inodes.
+
+ private:
+  friend class FakeFileLockBackend;
+
+  struct Inode
+  {
+    ino_t const m_number;                                       // The inode number.
+    std::vector<char> m_contents;                               // The contents of the file.
+    int m_lock_owner;                                           // The process id of the FakeFileLockBackend that holds the file lock, or 0.
+    bool m_mapped;                                              // Set once m_contents was handed out by map(); it can't be resized after that.
+
+    Inode(ino_t number) : m_number(number), m_lock_owner(0), m_mapped(false) { }
+  };
+
+  struct Data
+  {
+    std::map<std::filesystem::path, std::shared_ptr<Inode>> m_directory_entries;
+    ino_t m_last_inode_number = 0;
+  };
+  using Data_ts = threadsafe::Unlocked<Data, threadsafe::policy::Primitive<std::mutex>>;
+
+  Data_ts m_data;
+  std::atomic<std::chrono::nanoseconds::rep> m_latency;         // The simulated duration of every file system operation.
+
+ public:
+  FakeFileSystem() : m_latency(0) { }
+
+  // Let every operation (open, stat, lock, read, write, map) take `latency`.
+  void set_latency(std::chrono::nanoseconds latency) { m_latency.store(latency.count(), std::memory_order_relaxed); }
+
+  // Create an empty file path, if it doesn't already exist.
+  void create(std::filesystem::path const& path);
+  // Create path new_path for the same inode as existing_path (a hard link). Returns false if existing_path doesn't exist.
+  bool link(std::filesystem::path const& existing_path, std::filesystem::path const& new_path);
+  // Remove path. Open lock files keep their inode.
+  void remove(std::filesystem::path const& path);
+
+  // Return the process id that holds the file lock of path, or 0 if it isn't locked (or doesn't exist).
+  int lock_owner(std::filesystem::path const& path) const;
+
+ private:
+  void simulate_latency() const;
+  std::shared_ptr<Inode> create(Data_ts::wat const& data_w, std::filesystem::path const& path);
+};
+
+// class FakeFileLockBackend
+//
+// A FileLockBackend that uses a FakeFileSystem. The process_id identifies the simulated process:
+// two backends with a different process_id compete for the same file locks, and the PID written
+// to the lock file header by FileLock is the real one, but the one that holds the fake file lock is process_id.
+//
+class FakeFileLockBackend : public FileLockBackend
+{
+ private:
+  class FakeLockFile;
+
+  std::shared_ptr<FakeFileSystem> m_file_system;
+  int const m_process_id;
+
+ public:
+  FakeFileLockBackend(std::shared_ptr<FakeFileSystem> file_system, int process_id) :
+    m_file_system(std::move(file_system)), m_process_id(process_id)
+  {
+    // The process_id must be positive; 0 means 'unlocked'.
+    ASSERT(m_process_id > 0);
+  }
+
+  std::unique_ptr<LockFile> open(std::filesystem::path const& path) override;
+  bool stat(std::filesystem::path const& path, inode_id_type& inode_id) override;
+};
@@ -27,144 +27,229 @@
 
 #include "sys.h"
 #include "FileLock.h"
-#include <sys/types.h>
+#include "FileLockAccess.h"
+#include "LockDomain.h"
 #include <unistd.h>
+#include <cstring>
+#include <vector>
+
+FileLock::FileLock() : m_domain(&LockDomain::default_domain())
+{
+}
 
 void FileLock::set_filename(std::filesystem::path const& filename)
 {
   // Don't try to set an empty filename.
   ASSERT(!filename.empty());
+  // Don't set the filename of a FileLock twice.
+  ASSERT(!m_file_lock_instance);
   std::filesystem::path normal_path = std::filesystem::absolute(filename).lexically_normal();
 
+  m_file_lock_instance = m_domain->get_instance(normal_path);
+  if (m_file_lock_instance->canonical_path() != normal_path)
+    Dout(dc::warning, "FileLock::set_filename(" << filename << "): " << canonical_path() << " already exists and is the same file!");
+}
+
+void FileLock::set_on_acquire(FileLockSingleton::on_acquire_callback_type on_acquire_callback)
+{
+  // Call set_filename() first.
+  ASSERT(m_file_lock_instance);
+  FileLockSingleton::Data_ts::wat(m_file_lock_instance->m_data)->m_on_acquire_callback = std::move(on_acquire_callback);
+}
+
+void FileLock::set_shared_region_size(size_t size)
+{
+  // Call set_filename() first.
+  ASSERT(m_file_lock_instance);
+  ASSERT(size > 0);
+  FileLockSingleton::Data_ts::wat data_w(m_file_lock_instance->m_data);
+
+  if (data_w->m_mapping)
   {
-    file_lock_map_ts::wat file_lock_map_w(s_file_lock_map);
+    // The shared region was already mapped (by another FileLock with an equivalent path?), but smaller.
+    ASSERT(size <= data_w->m_shared_region_size);
+    return;
+  }
 
-    // Don't set the filename of a FileLock twice.
-    ASSERT(!m_file_lock_instance);
+  // The backend may only open and close the lock file while we do not hold the file lock
+  // (for POSIX, closing ANY file descriptor of the lock file releases the file lock).
+  // Since we hold m_data, that can not change while we're here.
+  ASSERT(data_w->m_number_of_FileLockAccess_objects == 0);
 
-    // Look if we already have a FileLock with the same or equivalent path.
-    std::error_code error_code;
-    for (auto iter = file_lock_map_w->begin(); iter != file_lock_map_w->end(); ++iter)
-    {
-      if (std::filesystem::equivalent((*iter)->canonical_path(), normal_path, error_code))
-      {
-        m_file_lock_instance = *iter;
-#ifdef CWDEBUG
-        if (normal_path != (*iter)->canonical_path())
-          Dout(dc::warning, "FileLock::set_filename(" << filename << "): " << canonical_path() << " already exists and is the same file!");
-#endif
-        return;
-      }
-      else if (error_code)
-      {
-        Dout(dc::warning, "Error: " << error_code.message());
-      }
-    }
-    // This file is not in our map. Add it.
-    auto res = file_lock_map_w->emplace(new FileLockSingleton(normal_path));
-    ASSERT(res.second);
-    m_file_lock_instance = *res.first;
-
-  } // Unlock s_file_lock_map.
-
-  // Sanity check.
-  // Note: our canonical means that it is the name stored in s_file_lock_map for that inode.
-  // However it can contain symbolic links: it is merely the (lexically normalized) path that
-  // was passed (first) to set_filename(). Lexically normalized means that occurances of '.'
-  // and '..' where removed from the path, but not symbolic links, if any. Boost filesystem
-  // also uses the word 'canonical' in which case they also remove symbolic links, but that
-  // is not how we use it.
-  ASSERT(canonical_path() == normal_path);
+  void* mapping = data_w->m_lock_file->map(FileLockSingleton::shared_region_offset + size);
+  data_w->m_mapping = static_cast<char*>(mapping);
+  data_w->m_shared_region_size = size;
+  Dout(dc::notice, "Mapped shared region of " << size << " bytes of " << m_file_lock_instance->canonical_path() << ".");
 }
 
-FileLock::~FileLock()
+FileLock::holder_type FileLock::query_holder(pid_t& pid) const
 {
-  if (!m_file_lock_instance)
-    return;
-  file_lock_map_ts::wat file_lock_map_w(s_file_lock_map);
-  auto iter = file_lock_map_w->find(m_file_lock_instance->canonical_path());
-  ASSERT(iter != file_lock_map_w->end());
-  if (iter->use_count() == 2)           // The one in the std::set and our own.
+  // Call set_filename() first.
+  ASSERT(m_file_lock_instance);
+  FileLockSingleton::Data_ts::wat data_w(m_file_lock_instance->m_data);
+  if (data_w->m_number_of_FileLockAccess_objects > 0)
+  {
+    pid = getpid();
+    return locked_by_this_process;
+  }
+  // We don't hold the file lock, and nobody in this process can obtain it while we have data_w.
+  pid = 0;
+  if (!data_w->m_lock_file->test_lock(pid))
+    return not_locked;
+  // If the backend couldn't tell us who has it, then try the PID that the holder wrote to the mapped header.
+  if (pid == 0 && data_w->m_mapping)
   {
-    // Do not destruct the last FileLock object that refers to a given FileLockSingleton
-    // (aka, canonical path of a file lock) while a FileLockAccess object for that still exists.
-    // That includes therefore AIStatefulTaskNamedMutex and AIStatefulTaskLockTask objects.
-    ASSERT(FileLockSingleton::Data_ts::rat(iter->get()->m_data)->m_number_of_FileLockAccess_objects == 0);
-    file_lock_map_w->erase(iter);
+    FileLockSingleton::LockFileHeader header;
+    std::memcpy(&header, data_w->m_mapping, sizeof(header));
+    pid = header.m_pid;
   }
+  return locked_by_other_process;
+}
+
+LockHandle FileLock::handle() const
+{
+  return m_domain->handle(*this);
+}
+
+FileLock::~FileLock()
+{
+  if (m_file_lock_instance)
+    m_domain->release_instance(m_file_lock_instance);
 }
 
 //static
-FileLock::file_lock_map_ts FileLock::s_file_lock_map;
+void FileLock::set_backend(std::shared_ptr<FileLockBackend> backend)
+{
+  LockDomain::default_domain().set_backend(std::move(backend));
+}
 
-void intrusive_ptr_add_ref(FileLockSingleton* p)
+//static
+void FileLock::load_registry_cache(std::filesystem::path const& cache_filename)
 {
-  FileLockSingleton::Data_ts::wat data_w(p->m_data);
-  if (data_w->m_number_of_FileLockAccess_objects++ == 0)
+  LockDomain::default_domain().load_registry_cache(cache_filename);
+}
+
+//static
+void FileLock::save_registry_cache(std::filesystem::path const& cache_filename)
+{
+  LockDomain::default_domain().save_registry_cache(cache_filename);
+}
+
+bool FileLockSingleton::add_ref(Data_ts::wat const& data_w, pid_t* lastpid)
+{
+  if (data_w->m_number_of_FileLockAccess_objects++ > 0)
+    return true;
+
+  FileLockBackend::LockFile& lock_file = *data_w->m_lock_file;
+
+  // Try to obtain the file lock.
+  if (!lock_file.try_lock())
   {
-    // Try to obtain the file lock.
-    bool const obtained_lock = data_w->m_file_lock.try_lock();
-
-    // (Try to) open file for reading from the start, and writing, in binary mode.
-    // Note that is extremely unlikely to fail when locking it succeeded (obtained_lock is true).
-    std::filesystem::path const canonical_path = p->canonical_path();
-    std::FILE* lock_file_stream = std::fopen(canonical_path.c_str(), "r+b");
-
-    // When either failed - we will throw. Reset m_number_of_FileLockAccess_objects before doing so.
-    if (!obtained_lock || !lock_file_stream)
-      data_w->m_number_of_FileLockAccess_objects = 0;
-
-    // Bail out when opening the lock file failed, but only when could lock the file at first (the unlikely case).
-    if (obtained_lock && !lock_file_stream)
-      THROW_ALERTE("Failed to open lock file [FILENAME] after locking it?!", AIArgs("[FILENAME]", canonical_path));
-
-    // Read the PID of the last process that obtained the file lock.
-    pid_t lastpid = 0;  // Use 0 for 'unknown' (that would be swapper or sched).
-    // Note that reading the PID here, without having the file lock (when obtained_lock is false thus),
-    // is a race condition; but in that case the result of this if statement only determines the text
-    // of the exception we're going to throw; so all is fine.
-    if (lock_file_stream && std::fread(reinterpret_cast<char*>(&lastpid), sizeof(lastpid), 1, lock_file_stream) != 1)
-      lastpid = 0;      // Reading PID failed.
-
-    // Bail out when locking the lock file failed.
-    if (!obtained_lock)
+    // Reset m_number_of_FileLockAccess_objects; nothing else was changed.
+    data_w->m_number_of_FileLockAccess_objects = 0;
+    if (lastpid)
     {
-      if (lock_file_stream)
-        std::fclose(lock_file_stream);
-      // If another process has the file lock, then we don't block but instead throw an error.
-      // Note that throwing aborts the constructor (of DatabaseFileLock) causing its destructor
-      // not to be called, and therefore automatically guarantees that the corresponding
-      // intrusive_ptr_release won't be called.
-      if (lastpid)
-        THROW_MALERT("Failed to obtain file lock [FILENAME]: it appears to be locked by process [PID].", AIArgs("FILENAME", canonical_path)("[PID]", lastpid));
-      else
-        THROW_MALERT("Failed to obtain file lock [FILENAME]: is it already locked by some other process?", AIArgs("FILENAME", canonical_path));
+      // Read the PID of the last process that obtained the file lock. Note that reading the header without
+      // having the file lock is a race condition; but the PID is only used to tell the user who appears to
+      // have the lock; so all is fine.
+      LockFileHeader header = {};
+      size_t const header_size = lock_file.read(&header, sizeof(header));
+      *lastpid = header_size >= sizeof(pid_t) ? header.m_pid : 0;      // Use 0 for 'unknown' (that would be swapper or sched).
     }
+    return false;
+  }
+
+  // Read the generation counter (and the PID of the previous holder).
+  LockFileHeader header = {};
+  size_t header_size;
+  try
+  {
+    header_size = lock_file.read(&header, sizeof(header));
+  }
+  catch (AIAlert::Error const&)
+  {
+    // Reading the lock file failed after we obtained the lock (the unlikely case).
+    // Reset m_number_of_FileLockAccess_objects before rethrowing.
+    lock_file.unlock();
+    data_w->m_number_of_FileLockAccess_objects = 0;
+    throw;
+  }
+  if (header_size != sizeof(header))
+    header.m_generation = 0;            // Empty lock file, or one written by an older version that only contained the PID.
+
+  Dout(dc::notice, "Obtained file lock " << print_using(*this, [&data_w](std::ostream& os, FileLockSingleton const& fls){ fls.print_on(os, data_w); }));
+
+  // If the generation counter in the file is still the one that we wrote ourselves, then nobody else held the lock in the meantime.
+  bool const other_process_held_lock = data_w->m_generation == 0 || header.m_generation != data_w->m_generation;
+
+  // Write our PID and the generation of this lock tenure to the file.
+  header.m_pid = getpid();
+  if (++header.m_generation == 0)       // Skip 0, which means 'unknown'.
+    header.m_generation = 1;
+  data_w->m_generation = header.m_generation;
+  if (!lock_file.write(&header, sizeof(header)))
+  {
+    Dout(dc::warning, "Could not write PID and generation to the lock file " << m_canonical_path << "!");
+    // Don't trust the generation that we think we wrote.
+    data_w->m_generation = 0;
+  }
+
+  // For example, flush in-memory caches of the protected data when they can not be trusted anymore.
+  if (data_w->m_on_acquire_callback)
+    data_w->m_on_acquire_callback(other_process_held_lock);
 
-    Dout(dc::notice, "Obtained file lock " << print_using(*p, [&data_w](std::ostream& os, FileLockSingleton const& fls){ fls.print_on(os, data_w); }));
+  return true;
+}
 
-    // Write our PID to the file if it wasn't already in there.
-    pid_t pid = getpid();
-    if (lastpid != pid)
+void intrusive_ptr_add_ref(FileLockSingleton* p)
+{
+  FileLockSingleton::Data_ts::wat data_w(p->m_data);
+  pid_t lastpid = 0;
+  // If another process has the file lock, then we don't block but instead throw an error.
+  // Note that throwing aborts the constructor (of DatabaseFileLock) causing its destructor
+  // not to be called, and therefore automatically guarantees that the corresponding
+  // intrusive_ptr_release won't be called.
+  if (!p->add_ref(data_w, &lastpid))
+  {
+    if (lastpid)
+      THROW_MALERT("Failed to obtain file lock [FILENAME]: it appears to be locked by process [PID].", AIArgs("FILENAME", p->canonical_path())("[PID]", lastpid));
+    else
+      THROW_MALERT("Failed to obtain file lock [FILENAME]: is it already locked by some other process?", AIArgs("FILENAME", p->canonical_path()));
+  }
+}
+
+//static
+std::vector<uint64_t> FileLockAccess::try_lock(FileLock* const* file_locks, size_t count, std::vector<FileLockAccess>& accesses)
+{
+  DoutEntering(dc::notice, "FileLockAccess::try_lock(file_locks, " << count << ", accesses)");
+  std::vector<uint64_t> obtained((count + 63) / 64);
+  accesses.reserve(accesses.size() + count);
+  for (size_t i = 0; i < count; ++i)
+  {
+    FileLockSingleton* file_lock_singleton = file_locks[i]->get_instance().get();
+    bool success;
     {
-      std::rewind(lock_file_stream);
-      if (std::fwrite(reinterpret_cast<char const*>(&pid), sizeof(pid), 1, lock_file_stream) != 1)
-        Dout(dc::warning, "Could not write PID to the lock file " << canonical_path << "!");
-      // We can't close the file as that would UNLOCK the boost::interprocess::file_lock!
-      p->m_lock_file = lock_file_stream;        // So we can close the file later.
-      // But we must flush the data asap.
-      std::fflush(lock_file_stream);
+      FileLockSingleton::Data_ts::wat data_w(file_lock_singleton->m_data);
+      try
+      {
+        // Don't ask for the PID of the holder: a busy lock then costs only the (failing) try_lock of the backend.
+        success = file_lock_singleton->add_ref(data_w, nullptr);
+      }
+      catch (AIAlert::Error const&)
+      {
+        // add_ref already restored the state.
+        Dout(dc::warning, "Failed to read lock file " << file_lock_singleton->canonical_path() << ".");
+        success = false;
+      }
+    }
+    if (success)
+    {
+      // Adopt the reference that add_ref added.
+      accesses.push_back(FileLockAccess(*file_locks[i], adopt_ref));
+      obtained[i / 64] |= uint64_t{1} << (i % 64);
     }
-
-#if 0 // FIXME
-    // Flush the in-memory caches of the database, because they cannot be trusted anymore.
-    Dout(dc::primbackup, "Obtained FILE lock for 'uploads' database, PID " << pid << ". Flushing in-memory cache of database...");
-    DatabaseFileLock file_lock;					// Calls this same function again and recursively locks p->mData a second time.
-    DatabaseAIStatefulTaskLock stateful_task_lock(file_lock);
-    ScopedBlockingBackEndAccess back_end_access(stateful_task_lock);
-    back_end_access->clear_memory_cache();
-#endif
   }
+  return obtained;
 }
 
 void intrusive_ptr_release(FileLockSingleton* p)
@@ -174,10 +259,7 @@ void intrusive_ptr_release(FileLockSingleton* p)
   ASSERT(data_w->m_number_of_FileLockAccess_objects > 0);
   if (--data_w->m_number_of_FileLockAccess_objects == 0)
   {
-    data_w->m_file_lock.unlock();
-    ASSERT(p->m_lock_file);
-    std::fclose(p->m_lock_file);
-    p->m_lock_file = nullptr;
+    data_w->m_lock_file->unlock();
     Dout(dc::notice, "Released file lock " << print_using(p, [&data_w](std::ostream& os, FileLockSingleton const& fls){ fls.print_on(os, data_w); }) << ".");
   }
 }
@@ -27,19 +27,28 @@
 
 #include "statefultask/AIStatefulTaskMutex.h"
 #include "utils/AIAlert.h"
+#include "FileLockBackend.h"
+#include "FileLockQueue.h"
+#include "LockHandle.h"
 #include "debug.h"
-#include <boost/interprocess/sync/file_lock.hpp>
 #include <boost/intrusive_ptr.hpp>
 #include <filesystem>
-#include <fstream>
+#include <functional>
+#include <memory>
+#include <atomic>
 #include <string>
 #include <set>
+#include <map>
+#include <utility>
+#include <cstdint>
+#include <sys/types.h>
 
 #pragma once
 
 class AIStatefulTask;
 class FileLock;
 class FileLockAccess;
+class LockDomain;
 
 // Helper class for FileLock.
 //
@@ -47,7 +56,7 @@ class FileLockAccess;
 // FileLock object, passed through std::filesystem::absolute(filename).lexically_normal(),
 // of all (subsequent) 'std::filesystem::equivalent' paths -- not the result of
 // std::filesystem::canonical which also removes all symbolic links), the threadsafe
-// boost::interprocess::file_lock instance with a reference count of the number of FileLockAccess
+// lock file (see FileLockBackend) with a reference count of the number of FileLockAccess
 // objects pointing to this instance, and an instance of AIStatefulTaskLockSingleton: a reference
 // counted pointer to the AIStatefulTask that owns the lock, if any.
 //
@@ -58,70 +67,104 @@ class FileLockSingleton : public AIStatefulTaskMutex
 {
   friend class FileLock;
   friend class FileLockAccess;
+  friend class LockDomain;
+
+ public:
+  // Type of the callback that is called every time that the file lock is obtained (see FileLock::set_on_acquire).
+  using on_acquire_callback_type = std::function<void (bool other_process_held_lock)>;
+  // Type that uniquely identifies an inode: the st_dev and st_ino of the lock file.
+  using inode_id_type = FileLockBackend::inode_id_type;
+
+ private:
+  // The layout of the data at the start of the lock file.
+  struct LockFileHeader
+  {
+    pid_t m_pid;                                                // The PID of the last process that obtained the file lock.
+    uint64_t m_generation;                                      // Incremented every time the file lock is obtained (by any process).
+  };
+
+ public:
+  // The offset of the shared memory region in the lock file (see FileLock::set_shared_region_size).
+  // This is also the maximum alignment that a type stored in the shared region may have.
+  static constexpr size_t shared_region_offset = 64;
+  static_assert(sizeof(LockFileHeader) <= shared_region_offset, "The shared region overlaps with the header.");
 
  private:
+
   struct Data
   {
     int m_number_of_FileLockAccess_objects;                     // The number of FileLockAccess objects that currently are in use (for this FileLockSingleton).
-    boost::interprocess::file_lock m_file_lock;                 // The file lock. Note that this, too, must be protected by a mutex
+    uint64_t m_generation;                                      // The generation that we wrote to the lock file the last time we obtained the file lock, or 0 if never.
+    on_acquire_callback_type m_on_acquire_callback;             // Called every time the file lock is obtained, if set.
+    char* m_mapping;                                            // Start of the lock file mapped into memory, or nullptr if there is no shared region.
+    size_t m_shared_region_size;                                // The size of the shared region that starts at m_mapping + shared_region_offset.
+    std::unique_ptr<FileLockBackend::LockFile> m_lock_file;     // The lock file. Note that this, too, must be protected by a mutex
                                                                 // (mostly for POSIX which does not guarantee thread synchronization).
-                                                                // The boost documentation advises to use the same thread to lock
-                                                                // and unlock a file-- but that is too restrictive imho.
   };
   using Data_ts = threadsafe::Unlocked<Data, threadsafe::policy::Primitive<std::mutex>>;
 
   Data_ts m_data;                                               // Threadsafe instance of Data, see above.
   std::filesystem::path const m_canonical_path;                 // The (canonical) path to the underlaying lock file.
-  std::FILE* m_lock_file;                                       // This points to an open file m_canonical_path once the file lock has been obtained.
-                                                                // it is used to write the PID to. We can't close it anymore because that also unlocks
-                                                                // the file lock!
+  inode_id_type m_inode_id;                                     // The inode of the lock file (set by FileLock::set_filename).
+  std::atomic<int> m_number_of_tasks;                           // The number of tasks that own, or are queued for, the task mutex (see FileLockAccess::lock_task).
+  std::atomic<bool> m_affinity;                                 // Set when tasks that had to wait for the task mutex should continue in the thread that released it.
+  FileLockQueue m_queue;                                        // The waiter queue of TaskLock objects, in front of the task mutex.
+  std::atomic<bool> m_recursive;                                // Set when a FileLockHolder that holds the lock may lock it again (see FileLock::set_recursive).
+  std::atomic<uint32_t> m_handle_index;                         // The index of the LockHandle of this file lock, or LockHandle::invalid_index (see LockDomain::handle).
 
  private:
   // Only class FileLock may construct objects of this type.
   // Note that it may only create ONE instance of FileLockSingleton PER
   // canonical path, otherwise this wouldn't be a singleton.
-  FileLockSingleton(std::filesystem::path const& canonical_path) : m_canonical_path(canonical_path)
+  FileLockSingleton(std::filesystem::path const& canonical_path, std::unique_ptr<FileLockBackend::LockFile> lock_file) :
+    m_canonical_path(canonical_path), m_number_of_tasks(0), m_affinity(false), m_recursive(false), m_handle_index(LockHandle::invalid_index)
   {
-    DoutEntering(dc::notice, "FileLockSingleton(" << canonical_path << ") [" << this << "]");
-    bool success = false;
-    do
-    {
-      try
-      {
-        // Open the file lock (this does not lock it).
-        boost::interprocess::file_lock file_lock(canonical_path.c_str());
-        // Transfer ownership to us.
-        Data_ts::wat data_w(m_data);
-        data_w->m_file_lock.swap(file_lock);
-        data_w->m_number_of_FileLockAccess_objects = 0;
-        success = true;
-      }
-      catch (boost::interprocess::interprocess_exception& error)
-      {
-        if (error.get_error_code() != boost::interprocess::not_found_error)
-          THROW_ALERTC(error.get_native_error(), "Failed to create file_lock([FILENAME])", AIArgs("[FILENAME]", canonical_path));
-        // File doesn't exist, create it and try again.
-        std::ofstream lockfile(canonical_path);
-        if (!lockfile.is_open())
-          THROW_ALERTE("Failed to create lock file [FILENAME].", AIArgs("[FILENAME]", canonical_path));
-        Dout(dc::notice, "Created non-existing lockfile " << canonical_path << ".");
-      }
-    }
-    while (!success);
+    DoutEntering(dc::notice, "FileLockSingleton(" << canonical_path << ", lock_file) [" << this << "]");
+    Data_ts::wat data_w(m_data);
+    data_w->m_number_of_FileLockAccess_objects = 0;
+    data_w->m_generation = 0;
+    data_w->m_mapping = nullptr;
+    data_w->m_shared_region_size = 0;
+    data_w->m_lock_file = std::move(lock_file);
   }
 
  public:
   ~FileLockSingleton()
   {
     DoutEntering(dc::notice, "~FileLockSingleton() [" << this << "]");
+    Data_ts::wat data_w(m_data);
+    if (data_w->m_mapping)
+      data_w->m_lock_file->unmap(data_w->m_mapping, shared_region_offset + data_w->m_shared_region_size);
+  }
+
+ private:
+  // Return a pointer to the start of the shared region that is at least `size` bytes large.
+  void* shared_region(size_t size) const
+  {
+    Data_ts::crat data_r(m_data);
+    // Call FileLock::set_shared_region_size before using a shared region.
+    ASSERT(data_r->m_mapping);
+    // Don't access more than was mapped.
+    ASSERT(size <= data_r->m_shared_region_size);
+    // You can only access the shared region while holding the file lock.
+    ASSERT(data_r->m_number_of_FileLockAccess_objects > 0);
+    return data_r->m_mapping + shared_region_offset;
   }
 
+ public:
+
   // Accessor.
   std::filesystem::path const& canonical_path() const
   {
     return m_canonical_path;
   }
 
+  // Increment the number of FileLockAccess objects, obtaining the file lock if this is the first one.
+  // Returns false, leaving everything unchanged, when the file lock is held by another process; if lastpid
+  // isn't nullptr, the header of the lock file is then read to set *lastpid to the PID of that process (or
+  // 0 if unknown). Throws only when reading the lock file fails.
+  bool add_ref(Data_ts::wat const& data_w, pid_t* lastpid);
+
   friend void intrusive_ptr_add_ref(FileLockSingleton* p);
   friend void intrusive_ptr_release(FileLockSingleton* p);
 
@@ -167,38 +210,16 @@ class FileLockSingleton : public AIStatefulTaskMutex
 // pass it to the constructor, but otherwise it is ok to pass it later-- but before they are
 // actually being used.
 //
-// FileLock is basically a wrapper around a boost::intrusive_ptr<FileLockSingleton>, along
-// with a static std::set<boost::intrusive_ptr<FileLockSingleton>> in order to take care of
+// FileLock is basically a wrapper around a std::shared_ptr<FileLockSingleton>, along with
+// the std::set<std::shared_ptr<FileLockSingleton>> of its LockDomain in order to take care of
 // creating and adding the new FileLockSingleton to this std::set whenever a new filelock is
 // added (through set_filename), making sure that only one instance of FileLockSingleton is
-// created per canonical path.
+// created per canonical path (per domain). A second index by inode is used to find equivalent paths.
 //
 class FileLock
 {
  private:
-  struct CanonicalPathCompare
-  {
-    bool operator()(std::shared_ptr<FileLockSingleton> const& p1, std::shared_ptr<FileLockSingleton> const& p2) const
-    {
-      // This compares if the paths have the same string representation.
-      // Therefore it must be guaranteed in somewhere else that a new path is
-      // not equivalent (doesn't resolve to the same actual file) before adding
-      // it to the set!
-      return p1->canonical_path() < p2->canonical_path();
-    }
-    // Allow direct comparision with std::filesystem::path.
-    using is_transparent = std::true_type;
-    bool operator()(std::filesystem::path const& canonical_path, std::shared_ptr<FileLockSingleton> const& p2) const
-    {
-      return canonical_path < p2->canonical_path();
-    }
-    bool operator()(std::shared_ptr<FileLockSingleton> const& p1, std::filesystem::path const& canonical_path) const
-    {
-      return p1->canonical_path() < canonical_path;
-    }
-  };
-  using file_lock_map_ts = threadsafe::Unlocked<std::set<std::shared_ptr<FileLockSingleton>, CanonicalPathCompare>, threadsafe::policy::Primitive<std::mutex>>;
-  static file_lock_map_ts s_file_lock_map;                              // Global map of all file locks by canonical path.
+  LockDomain* m_domain;                                            // The domain that this FileLock belongs to.
 
   // FileLockAccess instances created from this FileLock instance (or another that
   // points to the same FileLockSingleton) also point to the same FileLockSingleton instance.
@@ -208,15 +229,143 @@ class FileLock
 
  public:
   // Default constructor. Use set_filename() to associate the FileLock with an inode.
-  FileLock() { }
+  // The FileLock belongs to LockDomain::default_domain(), or to domain when passed.
+  FileLock();
+  FileLock(LockDomain& domain) : m_domain(&domain) { }
   // Construct a FileLock that is associated with the inode represented by filename.
   // If the file doesn't exist it is created.
-  FileLock(std::filesystem::path const& filename) { set_filename(filename); }
+  FileLock(std::filesystem::path const& filename) : FileLock() { set_filename(filename); }
+  FileLock(LockDomain& domain, std::filesystem::path const& filename) : m_domain(&domain) { set_filename(filename); }
   ~FileLock();
 
   // Set the file (inode) to use. If the file doesn't exist it is created.
+  // Throws when the file is already used as lock file by another LockDomain (see LockDomain).
   void set_filename(std::filesystem::path const& filename);
 
+  // The same as calling these functions of LockDomain::default_domain() (see LockDomain).
+  static void set_backend(std::shared_ptr<FileLockBackend> backend);
+  static void load_registry_cache(std::filesystem::path const& cache_filename);
+  static void save_registry_cache(std::filesystem::path const& cache_filename);
+
+  // Accessor.
+  LockDomain& domain() const { return *m_domain; }
+
+  // Return the dense handle of this file lock in its domain (see LockDomain::handle).
+  LockHandle handle() const;
+
+  // Set a callback that is called every time the (underlaying) file lock is obtained by this process.
+  //
+  // The argument passed is true when another process might have held the file lock since we released
+  // it the last time (always true the first time), and false when it is certain that nobody else held it
+  // in between: for example, an in-memory cache of the data protected by the lock only has to be flushed
+  // when other_process_held_lock is true. This is detected with a generation counter stored in the lock file.
+  //
+  // Since the callback belongs to the FileLockSingleton, it is shared by all FileLock objects with an
+  // equivalent path. It is called from the constructor of the FileLockAccess that obtained the file lock,
+  // while holding an internal mutex: it may not create FileLockAccess objects for this same file lock
+  // (it doesn't need to; the file lock is held while it runs) and it may not throw.
+  void set_on_acquire(FileLockSingleton::on_acquire_callback_type on_acquire_callback);
+
+  // Map a region of `size` bytes of the lock file into memory, shared with every other process that
+  // does the same for this lock file. The region is zero initialized when the file is first extended.
+  //
+  // The region can be accessed through FileLockAccess::shared_region<T>(), and thus only while the file
+  // lock is held; that makes the (OS) file lock also guard the contents of the shared region.
+  //
+  // Like set_filename, call this during initialization: while no FileLockAccess objects exist for
+  // this file lock. Calling it again, also through another FileLock with an equivalent path, is a
+  // no-op provided the size is not larger than the first time.
+  void set_shared_region_size(size_t size);
+
+  // Set the thread affinity hint of this file lock (shared with all FileLock objects with an equivalent path).
+  //
+  // When set, a TaskLock that has to wait for the task mutex continues in the thread that releases
+  // the mutex to it (by using the immediate handler), instead of being rescheduled on whatever thread
+  // of the thread pool picks it up first. Note that this only applies to the TaskLock itself: it then
+  // signals its parent, which still runs on its own handler. For the work that the lock protects to
+  // run on the releasing thread as well (keeping the protected data in the cache of that core), the
+  // parent has to call target(Handler::immediate) itself before it waits for its TaskLock.
+  void set_affinity(bool affinity)
+  {
+    // Call set_filename() first.
+    ASSERT(m_file_lock_instance);
+    m_file_lock_instance->m_affinity.store(affinity, std::memory_order_relaxed);
+  }
+
+  // Admission control (shared with all FileLock objects with an equivalent path).
+  //
+  // Limit the number of TaskLock objects that wait in the queue of this file lock to max_depth (0 means
+  // unlimited, the default). While the queue is saturated, new TaskLock objects wait for admission or,
+  // if they are fail fast (see TaskLock::set_fail_fast), abort immediately. Producers of work can
+  // poll saturated(), or set a callback, to slow down (see FileLockQueue::set_saturation_callback).
+  void set_max_queue_depth(size_t max_depth)
+  {
+    // Call set_filename() first.
+    ASSERT(m_file_lock_instance);
+    m_file_lock_instance->m_queue.set_max_depth(max_depth);
+  }
+
+  bool saturated() const
+  {
+    // Call set_filename() first.
+    ASSERT(m_file_lock_instance);
+    return m_file_lock_instance->m_queue.saturated();
+  }
+
+  void set_saturation_callback(FileLockQueue::saturation_callback_type saturation_callback)
+  {
+    // Call set_filename() first.
+    ASSERT(m_file_lock_instance);
+    m_file_lock_instance->m_queue.set_saturation_callback(std::move(saturation_callback));
+  }
+
+  // Return the waiting time statistics of the TaskLock objects of this file lock, per group (see TaskLock::set_group).
+  std::map<FileLockQueue::group_id_type, FileLockQueue::GroupStatistics> group_statistics() const
+  {
+    // Call set_filename() first.
+    ASSERT(m_file_lock_instance);
+    return m_file_lock_instance->m_queue.statistics();
+  }
+
+  // Enable (or disable) recursive mode (shared with all FileLock objects with an equivalent path).
+  //
+  // In recursive mode FileLockHolder::lock_file for a lock that the same task (the FileLockHolder) already
+  // holds only increments a counter, and FileLockHolder::unlock_file releases it at the matching final call.
+  // The task mutex itself is not recursive: a TaskLock always locks it as a new owner.
+  //
+  // Like set_shared_region_size, call this during initialization: while no task uses the lock.
+  void set_recursive(bool recursive)
+  {
+    // Call set_filename() first.
+    ASSERT(m_file_lock_instance);
+    // Don't change the mode while tasks use the lock.
+    ASSERT(m_file_lock_instance->m_number_of_tasks.load() == 0 && m_file_lock_instance->m_queue.size() == 0);
+    m_file_lock_instance->m_recursive.store(recursive, std::memory_order_relaxed);
+  }
+
+  // The result of query_holder.
+  enum holder_type
+  {
+    not_locked,                 // Nobody holds the (underlaying) file lock.
+    locked_by_this_process,     // A FileLockAccess object exists for this file lock.
+    locked_by_other_process     // Another process holds the file lock.
+  };
+
+  // Find out who holds the file lock, without obtaining it and without throwing.
+  //
+  // Sets pid to the PID of the holder, or 0 if unknown (or not_locked). This doesn't change the lock
+  // state and doesn't allocate memory (the POSIX backend uses F_GETLK on a file descriptor that it
+  // keeps open for this purpose); so it is cheap enough to be used to skip locks that are busy,
+  // for example from a scheduler. Of course, the result can be stale by the time it is used.
+  holder_type query_holder(pid_t& pid) const;
+
+  // Return true when another process holds the file lock.
+  bool is_locked_elsewhere() const
+  {
+    pid_t pid;
+    return query_holder(pid) == locked_by_other_process;
+  }
+
   std::filesystem::path canonical_path() const
   {
     // Don't call this function before calling set_filename().
@@ -226,6 +375,7 @@ class FileLock
 
  private:
   friend class FileLockAccess;
+  friend class LockDomain;
   std::shared_ptr<FileLockSingleton> const& get_instance() const
   {
     // Associate a FileLock with a path before passing it to a FileLockAccess object.
@@ -28,6 +28,10 @@
 #pragma once
 
 #include "FileLock.h"
+#include "LockDomain.h"
+#include <type_traits>
+#include <vector>
+#include <cstdint>
 
 // Locking the file lock.
 //
@@ -57,12 +61,49 @@ class FileLockAccess
     // You need to keep one around with a much longer lifetime.
     ASSERT(m_debug_weak_ptr.use_count() > 2);
   }
+  // Lock the file lock of handle, a handle of domain (see LockDomain::handle).
+  FileLockAccess(LockDomain const& domain, LockHandle handle) :
+    DEBUG_ONLY(m_debug_weak_ptr(domain.owner(handle)),) m_file_lock_ptr(&domain.instance(handle)) { }
 
+  // Try to obtain the file locks of file_locks[0] through file_locks[count - 1] in one go, without throwing.
+  //
+  // Returns a bitmap in which bit i % 64 of word i / 64 is set when the file lock of file_locks[i] was
+  // obtained; a FileLockAccess for it is then appended to accesses (in the order of file_locks).
+  // Failed attempts leave no state behind. Use this, for example, to find out which of a large number
+  // of candidates can be locked right now: the cost is one try_lock per file lock, of the backend.
+  // The lock file of a busy lock isn't read; use FileLock::query_holder to find out who holds it.
+  static std::vector<uint64_t> try_lock(FileLock* const* file_locks, size_t count, std::vector<FileLockAccess>& accesses);
+
+ private:
+  // Construct a FileLockAccess that adopts the reference that was already added (see try_lock).
+  struct adopt_ref_t { };
+  static constexpr adopt_ref_t adopt_ref{};
+  FileLockAccess(FileLock& file_lock, adopt_ref_t) :
+    DEBUG_ONLY(m_debug_weak_ptr(file_lock.get_instance()),) m_file_lock_ptr(file_lock.get_instance().get(), false) { }
+
+ public:
 #if CW_DEBUG
   // The default copy constructor suffices, but this one has a debug check builtin.
+  // Copying a moved-from object (that no longer refers to any FileLockSingleton) is allowed.
   FileLockAccess(FileLockAccess const& file_lock_access) :
-    m_debug_weak_ptr(file_lock_access.debug_weak_ptr()), m_file_lock_ptr(file_lock_access.m_file_lock_ptr) { }
+    m_debug_weak_ptr(file_lock_access.m_file_lock_ptr ? file_lock_access.debug_weak_ptr() : file_lock_access.m_debug_weak_ptr),
+    m_file_lock_ptr(file_lock_access.m_file_lock_ptr) { }
+  // Likewise for the move constructor. The moved-from object no longer refers to any FileLockSingleton.
+  FileLockAccess(FileLockAccess&& file_lock_access) noexcept :
+    m_debug_weak_ptr(std::move(file_lock_access.m_debug_weak_ptr)), m_file_lock_ptr(std::move(file_lock_access.m_file_lock_ptr))
+  {
+    // See the assert in debug_weak_ptr().
+    ASSERT(!m_file_lock_ptr || !m_debug_weak_ptr.expired());
+  }
+#else
+  FileLockAccess(FileLockAccess const&) = default;
+  // Moving transfers the reference without touching the reference count (and therefore without locking m_data).
+  FileLockAccess(FileLockAccess&&) noexcept = default;
+#endif
+  FileLockAccess& operator=(FileLockAccess const&) = default;
+  FileLockAccess& operator=(FileLockAccess&&) noexcept = default;
 
+#if CW_DEBUG
  public:
   std::weak_ptr<FileLockSingleton> const& debug_weak_ptr() const
   {
@@ -88,18 +129,93 @@ class FileLockAccess
  public:
   bool lock_task(AIStatefulTask* task, AIStatefulTask::condition_type condition)
   {
+    m_file_lock_ptr->m_number_of_tasks.fetch_add(1, std::memory_order_relaxed);
     return m_file_lock_ptr->lock(task, condition);
   }
 
   void unlock_task()
   {
+    m_file_lock_ptr->m_number_of_tasks.fetch_sub(1, std::memory_order_relaxed);
     m_file_lock_ptr->unlock();
   }
 
+  // Return true if the file lock is in recursive mode (see FileLock::set_recursive).
+  bool is_recursive() const
+  {
+    return m_file_lock_ptr->m_recursive.load(std::memory_order_relaxed);
+  }
+
+  // Request the grant of the waiter queue of this file lock (see FileLockQueue).
+  // Unless the grant is obtained immediately, or the deadline already passed, request.m_task is signalled once it is granted.
+  FileLockQueue::enqueue_result enqueue(FileLockQueue::Request const& request)
+  {
+    return m_file_lock_ptr->m_queue.enqueue(request);
+  }
+
+  // Return true if the waiter queue of this file lock is saturated (see FileLock::set_max_queue_depth).
+  bool saturated() const
+  {
+    return m_file_lock_ptr->m_queue.saturated();
+  }
+
+  // See FileLockQueue::requeue and FileLockQueue::should_yield.
+  FileLockQueue::enqueue_result requeue(FileLockQueue::Request const& request)
+  {
+    return m_file_lock_ptr->m_queue.requeue(request);
+  }
+
+  bool should_yield(FileLockQueue::clock_type::time_point deadline, std::chrono::nanoseconds max_wait) const
+  {
+    return m_file_lock_ptr->m_queue.should_yield(deadline, max_wait);
+  }
+
+  // See FileLockQueue::remove.
+  bool remove_from_queue(AIStatefulTask* task)
+  {
+    return m_file_lock_ptr->m_queue.remove(task);
+  }
+
+  // Pass the grant obtained with enqueue on to the next waiter.
+  void release_grant()
+  {
+    m_file_lock_ptr->m_queue.release();
+  }
+
+  // Return true if tasks that had to wait for the task mutex should continue in the thread that released it (see FileLock::set_affinity).
+  bool has_affinity() const
+  {
+    return m_file_lock_ptr->m_affinity.load(std::memory_order_relaxed);
+  }
+
+  // Return the number of tasks that currently own, or are waiting for, the task mutex (including its waiter queue).
+  // This is a snapshot that is only useful as a hint (e.g. to pick the least contended lock).
+  int task_contention() const
+  {
+    return m_file_lock_ptr->m_number_of_tasks.load(std::memory_order_relaxed) + static_cast<int>(m_file_lock_ptr->m_queue.size());
+  }
+
+  // Accessor.
+  std::filesystem::path const& canonical_path() const { return m_file_lock_ptr->canonical_path(); }
+
+  // Return a pointer to the shared region of the lock file (see FileLock::set_shared_region_size).
+  //
+  // The pointer may only be used while (this, or another) FileLockAccess exists for this file lock:
+  // that is what guarantees that no other process accesses the region at the same time. Note that
+  // threads of this process still have to coordinate, for example by using lock_task.
+  template<typename T>
+  T* shared_region() const
+  {
+    static_assert(std::is_trivially_copyable_v<T>, "Only trivially copyable types can be stored in shared memory.");
+    static_assert(alignof(T) <= FileLockSingleton::shared_region_offset, "Alignment of T is too large for the shared region.");
+    return static_cast<T*>(m_file_lock_ptr->shared_region(sizeof(T)));
+  }
+
 #ifdef CWDEBUG
   void print_on(std::ostream& os) const
   {
-    if (m_debug_weak_ptr.expired())
+    if (!m_file_lock_ptr)
+      os << "*{moved-from}";
+    else if (m_debug_weak_ptr.expired())
       os << "*{deleted FileLockSingleton}";
     else
       os << "{a" << utils::print_using(m_file_lock_ptr, &FileLockSingleton::print_on) << "a}";
@@ -0,0 +1,93 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class FileLockBackend.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+// class FileLockBackend
+//
+// The interface through which FileLock accesses the file system and the operating system file locks.
+//
+// The default backend, PosixFileLockBackend, uses real files. FakeFileLockBackend simulates
+// lock files, inodes and file locks in memory, for deterministic tests and benchmarks.
+// See LockDomain::set_backend.
+//
+class FileLockBackend
+{
+ public:
+  // Type that uniquely identifies an inode (for the real file system: the st_dev and st_ino of the file).
+  using inode_id_type = std::pair<dev_t, ino_t>;
+
+  // An open lock file. There is one such object per FileLockSingleton.
+  // The caller (FileLockSingleton) serializes all calls.
+  class LockFile
+  {
+   public:
+    virtual ~LockFile() = default;
+
+    // Return the inode of the file that was opened (which is not necessarily the inode that path refers to now).
+    virtual inode_id_type inode_id() const = 0;
+    // Try to obtain the inter-process lock of the file. Never blocks.
+    virtual bool try_lock() = 0;
+    // Release the lock obtained with try_lock.
+    virtual void unlock() = 0;
+    // Return true if another process holds the lock, without obtaining it. Sets holder to the PID of
+    // that process, or 0 if unknown. Only called while not holding the lock; must not allocate memory.
+    virtual bool test_lock(pid_t& holder) = 0;
+    // Read up to size bytes from the start of the file and return the number of bytes read.
+    // This is also called after try_lock failed, in order to find out who holds the lock.
+    virtual size_t read(void* buffer, size_t size) = 0;
+    // Write size bytes to the start of the file, making them visible to other processes. Only called while holding the lock.
+    // Returns false on failure.
+    virtual bool write(void const* buffer, size_t size) = 0;
+    // Map the first size bytes of the file into memory, shared with other processes, extending the file if it is smaller.
+    // Only called while not holding the lock.
+    virtual void* map(size_t size) = 0;
+    // Undo map.
+    virtual void unmap(void* mapping, size_t size) = 0;
+  };
+
+  virtual ~FileLockBackend() = default;
+
+  // Open the lock file path, creating it if it doesn't exist.
+  virtual std::unique_ptr<LockFile> open(std::filesystem::path const& path) = 0;
+
+  // Get the inode of path. Returns false if path doesn't exist.
+  virtual bool stat(std::filesystem::path const& path, inode_id_type& inode_id) = 0;
+
+  // Remove the entries whose path no longer refers to the given inode (see LockDomain::load_registry_cache).
+  virtual void verify(std::vector<std::pair<std::filesystem::path, inode_id_type>>& entries);
+
+  // Return a value that identifies the owner of the file locks obtained through this backend: locks of backends
+  // with the same owner don't exclude each other. The default is the backend itself (e.g. a simulated process).
+  virtual void const* lock_owner() const { return this; }
+};
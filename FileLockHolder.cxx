@@ -0,0 +1,168 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class FileLockHolder.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "FileLockHolder.h"
+#include <algorithm>
+
+namespace task {
+
+TaskLock& FileLockHolder::lock_file(FileLockAccess file_lock_access, condition_type condition)
+{
+  if (file_lock_access.is_recursive())
+  {
+    task_locks_ts::wat task_locks_w(m_task_locks);
+    for (auto const& held : task_locks_w->m_locks)
+      if (held->file_lock_access().canonical_path() == file_lock_access.canonical_path())
+      {
+        // In recursive mode, only lock a file again after obtaining it (wait for the condition of the first lock_file).
+        ASSERT(held->is_locked());
+        // Every entry in m_task_locks counts as one lock: the TaskLock is released when the last one is removed.
+        boost::intrusive_ptr<TaskLock> task_lock = held;
+        task_locks_w->m_locks.push_back(task_lock);
+        signal(condition);
+        return *task_lock;
+      }
+  }
+  boost::intrusive_ptr<TaskLock> task_lock = statefultask::create<TaskLock>(std::move(file_lock_access));
+  task_lock->set_task_type(task_name_impl());
+  task_locks_ts::wat(m_task_locks)->m_locks.push_back(task_lock);
+  task_lock->run(this, condition);
+  return *task_lock;
+}
+
+namespace {
+
+// Remove task_lock from task_locks and return it.
+boost::intrusive_ptr<TaskLock> remove_task_lock(std::vector<boost::intrusive_ptr<TaskLock>>& task_locks, TaskLock& task_lock)
+{
+  auto iter = std::find_if(task_locks.begin(), task_locks.end(),
+      [&task_lock](boost::intrusive_ptr<TaskLock> const& ptr){ return ptr.get() == &task_lock; });
+  // Only pass TaskLock objects returned by lock_file (or find_file), and only once.
+  ASSERT(iter != task_locks.end());
+  boost::intrusive_ptr<TaskLock> result = std::move(*iter);
+  task_locks.erase(iter);
+  return result;
+}
+
+} // namespace
+
+void FileLockHolder::unlock_file(TaskLock& task_lock)
+{
+  boost::intrusive_ptr<TaskLock> removed;
+  {
+    task_locks_ts::wat task_locks_w(m_task_locks);
+    removed = remove_task_lock(task_locks_w->m_locks, task_lock);
+    // In recursive mode, only the matching final unlock_file releases the lock.
+    if (std::find(task_locks_w->m_locks.begin(), task_locks_w->m_locks.end(), removed) != task_locks_w->m_locks.end())
+      return;
+  }
+  removed->abandon();
+}
+
+void FileLockHolder::unlock_all_files()
+{
+  release_files(false);
+}
+
+void FileLockHolder::release_files(bool close)
+{
+  task_locks_type task_locks;
+  {
+    task_locks_ts::wat task_locks_w(m_task_locks);
+    task_locks_w->m_locks.swap(task_locks);
+    if (close)
+      task_locks_w->m_closed = true;
+  }
+  Dout(dc::statefultask, "Releasing " << task_locks.size() << " file locks of [" << this << "].");
+  // Note that a TaskLock can occur more than once in recursive mode; abandon() may be called more than once.
+  for (auto& task_lock : task_locks)
+    task_lock->abandon();
+}
+
+TaskLock* FileLockHolder::find_file(FileLock const& file_lock) const
+{
+  std::filesystem::path canonical_path = file_lock.canonical_path();
+  task_locks_ts::crat task_locks_r(m_task_locks);
+  for (auto const& task_lock : task_locks_r->m_locks)
+    if (task_lock->file_lock_access().canonical_path() == canonical_path)
+      return task_lock.get();
+  return nullptr;
+}
+
+bool FileLockHolder::transfer_file(TaskLock& task_lock, FileLockHolder& new_holder, condition_type condition)
+{
+  // Only transfer a lock that is held.
+  ASSERT(task_lock.is_locked());
+  // In recursive mode, all our references (the recursion depth) are transferred.
+  task_locks_type transferred;
+  {
+    task_locks_ts::wat task_locks_w(m_task_locks);
+    auto& locks = task_locks_w->m_locks;
+    auto first = std::stable_partition(locks.begin(), locks.end(),
+        [&task_lock](boost::intrusive_ptr<TaskLock> const& ptr){ return ptr.get() != &task_lock; });
+    // Only pass TaskLock objects returned by lock_file (or find_file).
+    ASSERT(first != locks.end());
+    transferred.assign(std::make_move_iterator(first), std::make_move_iterator(locks.end()));
+    locks.erase(first, locks.end());
+  }
+  {
+    // Check m_closed while holding the lock of new_holder, so that it can't release its locks before we added ours.
+    task_locks_ts::wat new_task_locks_w(new_holder.m_task_locks);
+    if (!new_task_locks_w->m_closed)
+    {
+      Dout(dc::statefultask, "Transferring " << task_lock.file_lock_access() << " from [" << this << "] to [" << &new_holder << "].");
+      auto& new_locks = new_task_locks_w->m_locks;
+      new_locks.insert(new_locks.end(), std::make_move_iterator(transferred.begin()), std::make_move_iterator(transferred.end()));
+      transferred.clear();
+    }
+  }
+  if (!transferred.empty())
+  {
+    Dout(dc::warning, "Not transferring " << task_lock.file_lock_access() << " to [" << &new_holder << "], which already finished or aborted.");
+    // Keep the lock.
+    task_locks_ts::wat task_locks_w(m_task_locks);
+    auto& locks = task_locks_w->m_locks;
+    locks.insert(locks.end(), std::make_move_iterator(transferred.begin()), std::make_move_iterator(transferred.end()));
+    return false;
+  }
+  new_holder.signal(condition);
+  return true;
+}
+
+void FileLockHolder::finish_impl()
+{
+  release_files(true);
+}
+
+void FileLockHolder::abort_impl()
+{
+  release_files(true);
+}
+
+} // namespace task
@@ -0,0 +1,118 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class FileLockHolder.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "TaskLock.h"
+#include <vector>
+
+namespace task {
+
+// Base class for tasks that hold file locks.
+//
+// Instead of running TaskLock children by hand and calling unlock() on each of them, derive
+// from FileLockHolder and use lock_file. All locks obtained (or still being obtained) that way
+// are released together when the task finishes or aborts: every lock that is held is unlocked
+// (waking up its next waiter once), every lock that is still queued is released as soon as it
+// is granted, and the references to the TaskLock objects (and therefore their FileLockAccess)
+// are dropped.
+//
+// Usage:
+//
+//   case MyTask_lock:
+//     lock_file(file_lock_access, 1);
+//     set_state(MyTask_locked);
+//     wait(1);
+//     break;
+//   case MyTask_locked:
+//     // ... use the resource ...
+//     finish();        // Releases the lock.
+//
+// A held lock can be handed over to another FileLockHolder with transfer_file, without releasing it
+// in between: no other task can obtain the lock in the meantime and the file lock (FileLockAccess)
+// stays referenced, so the OS lock isn't touched either. The receiving task is signalled and can find
+// the lock with find_file. For example, a producer that wrote a file passes it on to its consumer:
+//
+//   case Producer_done:
+//     transfer_file(*find_file(m_file_lock), *m_consumer, 1);
+//     finish();        // Doesn't release the transferred lock.
+//
+// A lock can not be transferred to a task that already finished or aborted (it released its locks already);
+// transfer_file returns false then and we keep the lock (so the above finish() releases it).
+//
+// A derived class that overrides finish_impl or abort_impl must call the one of FileLockHolder.
+//
+class FileLockHolder : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+ private:
+  using task_locks_type = std::vector<boost::intrusive_ptr<TaskLock>>;
+  struct TaskLocks
+  {
+    task_locks_type m_locks;            // All locks obtained with lock_file (or transferred to us) and not released yet.
+    bool m_closed = false;              // Set when this task finishes or aborts: no locks can be transferred to it anymore.
+  };
+  using task_locks_ts = threadsafe::Unlocked<TaskLocks, threadsafe::policy::Primitive<std::mutex>>;
+  task_locks_ts m_task_locks;           // Protected by a mutex because transfer_file is called by another task.
+
+ public:
+  static state_type constexpr state_end = direct_base_type::state_end;
+
+ protected:
+  FileLockHolder(CWDEBUG_ONLY(bool debug)) : AIStatefulTask(CWDEBUG_ONLY(debug)) { }
+  ~FileLockHolder() { ASSERT(task_locks_ts::rat(m_task_locks)->m_locks.empty()); }
+
+  // Obtain the task mutex of file_lock_access. This task is signalled with condition once the lock is held.
+  // If the file lock is in recursive mode (see FileLock::set_recursive) and we already hold it, this only
+  // increments a counter (and signals condition): then the lock is released by the matching final unlock_file.
+  TaskLock& lock_file(FileLockAccess file_lock_access, condition_type condition);
+
+  // Release a lock obtained with lock_file before this task finishes.
+  void unlock_file(TaskLock& task_lock);
+
+  // Release all locks obtained with lock_file.
+  void unlock_all_files();
+
+  // Return the TaskLock that we hold (or are obtaining) for file_lock, or nullptr if there is none.
+  TaskLock* find_file(FileLock const& file_lock) const;
+
+  // Hand over a held lock (obtained with lock_file, or transferred to us) to new_holder and signal it with condition.
+  // Returns false, keeping the lock, if new_holder already finished or aborted.
+  bool transfer_file(TaskLock& task_lock, FileLockHolder& new_holder, condition_type condition);
+
+  void finish_impl() override;
+  void abort_impl() override;
+
+ private:
+  // Release all locks; if close is set, also refuse locks that are transferred to us from now on.
+  void release_files(bool close);
+};
+
+} // namespace task
@@ -0,0 +1,331 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class FileLockQueue.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FileLockQueue.h"
+#include "DeadlineTimer.h"
+#include <algorithm>
+
+void FileLockQueue::GroupStatistics::add(std::chrono::nanoseconds wait)
+{
+  ++m_grants;
+  m_total_wait += wait;
+  m_max_wait = std::max(m_max_wait, wait);
+  int bucket = 0;
+  for (auto ns = wait.count(); ns > 0 && bucket < number_of_buckets - 1; ns >>= 1)
+    ++bucket;
+  ++m_histogram[bucket];
+}
+
+std::chrono::nanoseconds FileLockQueue::GroupStatistics::percentile(double fraction) const
+{
+  uint64_t const needed = static_cast<uint64_t>(fraction * m_grants);
+  uint64_t count = 0;
+  for (int bucket = 0; bucket < number_of_buckets; ++bucket)
+  {
+    count += m_histogram[bucket];
+    if (count > needed || count == m_grants)
+      return std::min(m_max_wait, std::chrono::nanoseconds((int64_t{1} << bucket) - 1));
+  }
+  return m_max_wait;
+}
+
+//static
+void FileLockQueue::tag(Data_ts::wat const& data_w, Waiter& waiter)
+{
+  // A weight of zero would never be served.
+  ASSERT(waiter.m_request.m_weight > 0);
+  Group& group = data_w->m_groups[waiter.m_request.m_group];
+  waiter.m_start_tag = std::max(data_w->m_virtual_time, group.m_last_finish_tag);
+  group.m_last_finish_tag = waiter.m_start_tag + 1.0 / waiter.m_request.m_weight;
+  waiter.m_sequence = ++data_w->m_last_sequence;
+  data_w->m_max_start_tag = std::max(data_w->m_max_start_tag, waiter.m_start_tag);
+}
+
+//static
+void FileLockQueue::push_admission(Data_ts::wat const& data_w, Waiter const& waiter)
+{
+  uint64_t const arrival = ++data_w->m_last_arrival;
+  data_w->m_admission.emplace(arrival, waiter);
+  if (waiter.m_request.m_deadline != clock_type::time_point::max())
+    data_w->m_admission_deadlines.emplace(waiter.m_request.m_deadline, arrival);
+}
+
+//static
+void FileLockQueue::erase_admission(Data_ts::wat const& data_w, admission_type::iterator waiter)
+{
+  data_w->m_admission_deadlines.erase({waiter->second.m_request.m_deadline, waiter->first});
+  data_w->m_admission.erase(waiter);
+}
+
+//static
+void FileLockQueue::drop_expired(Data_ts::wat const& data_w, clock_type::time_point now, std::vector<Request>& dropped)
+{
+  auto drop = [&](Waiter const& waiter){
+    ++data_w->m_groups[waiter.m_request.m_group].m_statistics.m_deadline_misses;
+    if (waiter.m_request.m_deadline_missed)
+      *waiter.m_request.m_deadline_missed = true;
+    dropped.push_back(waiter.m_request);
+  };
+  // The waiters are ordered by deadline first: the expired ones are at the front.
+  auto& waiters = data_w->m_waiters;
+  while (!waiters.empty() && waiters.begin()->m_request.m_deadline <= now)
+  {
+    drop(*waiters.begin());
+    waiters.erase(waiters.begin());
+  }
+  auto& deadlines = data_w->m_admission_deadlines;
+  while (!deadlines.empty() && deadlines.begin()->first <= now)
+  {
+    auto waiter = data_w->m_admission.find(deadlines.begin()->second);
+    drop(waiter->second);
+    erase_admission(data_w, waiter);
+  }
+}
+
+void FileLockQueue::admit(Data_ts::wat const& data_w)
+{
+  while (!data_w->m_admission.empty() && !is_saturated(data_w))
+  {
+    auto first = data_w->m_admission.begin();
+    Waiter waiter = first->second;
+    erase_admission(data_w, first);
+    tag(data_w, waiter);
+    data_w->m_waiters.insert(waiter);
+  }
+  bool const saturated = is_saturated(data_w);
+  if (saturated != data_w->m_saturated)
+  {
+    data_w->m_saturated = saturated;
+    if (data_w->m_saturation_callback)
+      data_w->m_saturation_callback(saturated);
+  }
+  clock_type::time_point earliest_deadline = clock_type::time_point::max();
+  if (!data_w->m_waiters.empty())
+    earliest_deadline = data_w->m_waiters.begin()->m_request.m_deadline;
+  if (!data_w->m_admission_deadlines.empty())
+    earliest_deadline = std::min(earliest_deadline, data_w->m_admission_deadlines.begin()->first);
+  // Arm while holding the lock, so that the armed deadline can't be overwritten by a stale one.
+  if (earliest_deadline != data_w->m_armed_deadline)
+  {
+    data_w->m_armed_deadline = earliest_deadline;
+    DeadlineTimer::instance().arm(this, earliest_deadline);
+  }
+}
+
+FileLockQueue::~FileLockQueue()
+{
+  DeadlineTimer::instance().disarm(this);
+}
+
+void FileLockQueue::expire()
+{
+  std::vector<Request> dropped;
+  {
+    Data_ts::wat data_w(m_data);
+    drop_expired(data_w, clock_type::now(), dropped);
+    // The timer fired; arm it again for the next deadline, if any.
+    data_w->m_armed_deadline = clock_type::time_point::max();
+    admit(data_w);
+  }
+  // This must be the last use of `this`: a dropped task might destroy the queue (see DeadlineTimer::disarm).
+  signal_dropped(dropped);
+}
+
+void FileLockQueue::set_max_depth(size_t max_depth)
+{
+  Data_ts::wat data_w(m_data);
+  data_w->m_max_depth = max_depth;
+  admit(data_w);
+}
+
+//static
+void FileLockQueue::signal_dropped(std::vector<Request> const& dropped)
+{
+  for (Request const& request : dropped)
+    request.m_task->signal(request.m_condition);
+}
+
+FileLockQueue::enqueue_result FileLockQueue::enqueue(Request const& request)
+{
+  clock_type::time_point const now = clock_type::now();
+  std::vector<Request> dropped;
+  enqueue_result result = queued;
+  {
+    Data_ts::wat data_w(m_data);
+    drop_expired(data_w, now, dropped);
+    if (request.m_deadline <= now)
+    {
+      ++data_w->m_groups[request.m_group].m_statistics.m_deadline_misses;
+      result = deadline_missed;
+    }
+    else
+    {
+      Waiter waiter{request, 0.0, 0, now};
+      if (!data_w->m_granted)
+      {
+        // The queue must be empty when nobody has the grant.
+        ASSERT(data_w->m_waiters.empty() && data_w->m_admission.empty());
+        tag(data_w, waiter);
+        data_w->m_granted = true;
+        data_w->m_virtual_time = waiter.m_start_tag;
+        data_w->m_groups[request.m_group].m_statistics.add(std::chrono::nanoseconds::zero());
+        result = granted;
+      }
+      else if (is_saturated(data_w) || !data_w->m_admission.empty())
+      {
+        if (request.m_fail_fast)
+        {
+          ++data_w->m_groups[request.m_group].m_statistics.m_rejections;
+          result = rejected;
+        }
+        else
+          push_admission(data_w, waiter);               // Don't overtake requests that are already waiting for admission.
+      }
+      else
+      {
+        tag(data_w, waiter);
+        data_w->m_waiters.insert(waiter);
+      }
+    }
+    admit(data_w);
+  }
+  signal_dropped(dropped);
+  return result;
+}
+
+void FileLockQueue::release()
+{
+  clock_type::time_point const now = clock_type::now();
+  std::vector<Request> dropped;
+  Request next{};
+  {
+    Data_ts::wat data_w(m_data);
+    // Only the task that has the grant can release it.
+    ASSERT(data_w->m_granted);
+    drop_expired(data_w, now, dropped);
+    // Don't leave requests waiting for admission when all waiters were dropped.
+    admit(data_w);
+    if (data_w->m_waiters.empty())
+    {
+      // Nobody waits for admission when the queue is empty.
+      ASSERT(data_w->m_admission.empty());
+      data_w->m_granted = false;
+    }
+    else
+      next = pass_grant(data_w, now);   // The grant is passed on: m_granted stays true.
+  }
+  signal_dropped(dropped);
+  if (next.m_task)
+    next.m_task->signal(next.m_condition);
+}
+
+FileLockQueue::Request FileLockQueue::pass_grant(Data_ts::wat const& data_w, clock_type::time_point now)
+{
+  auto& waiters = data_w->m_waiters;
+  // The waiters are in the order in which they are served.
+  auto best = waiters.begin();
+  Request next = best->m_request;
+  data_w->m_virtual_time = std::max(data_w->m_virtual_time, best->m_start_tag);
+  data_w->m_groups[next.m_group].m_statistics.add(std::chrono::duration_cast<std::chrono::nanoseconds>(now - best->m_enqueued));
+  waiters.erase(best);
+  admit(data_w);
+  return next;
+}
+
+FileLockQueue::enqueue_result FileLockQueue::requeue(Request const& request)
+{
+  clock_type::time_point const now = clock_type::now();
+  std::vector<Request> dropped;
+  Request next{};
+  {
+    Data_ts::wat data_w(m_data);
+    // Only the task that has the grant can requeue.
+    ASSERT(data_w->m_granted);
+    drop_expired(data_w, now, dropped);
+    admit(data_w);
+    // If nobody is waiting then there is nobody to yield to: keep the grant.
+    if (!data_w->m_waiters.empty())
+    {
+      // Queue the request behind all current waiters: without deadline and with the largest start tag.
+      Waiter waiter{request, 0.0, 0, now};
+      waiter.m_request.m_deadline = clock_type::time_point::max();
+      // No current waiter has a larger start tag than m_max_start_tag, and ties are broken by the (largest) sequence number.
+      tag(data_w, waiter);
+      waiter.m_start_tag = data_w->m_max_start_tag;
+      data_w->m_groups[request.m_group].m_last_finish_tag = waiter.m_start_tag + 1.0 / request.m_weight;
+      // Note that this can exceed the maximum depth: the request was already admitted.
+      data_w->m_waiters.insert(waiter);
+      next = pass_grant(data_w, now);
+    }
+  }
+  // Also when keeping the grant: drop_expired might have removed requests from the queue.
+  signal_dropped(dropped);
+  if (!next.m_task)
+    return granted;
+  next.m_task->signal(next.m_condition);
+  return queued;
+}
+
+bool FileLockQueue::remove(AIStatefulTask* task)
+{
+  Data_ts::wat data_w(m_data);
+  auto of_task = [task](Waiter const& waiter){ return waiter.m_request.m_task == task; };
+  auto waiter = std::find_if(data_w->m_waiters.begin(), data_w->m_waiters.end(), of_task);
+  if (waiter != data_w->m_waiters.end())
+    data_w->m_waiters.erase(waiter);
+  else
+  {
+    auto admission_waiter = std::find_if(data_w->m_admission.begin(), data_w->m_admission.end(),
+        [&of_task](admission_type::value_type const& entry){ return of_task(entry.second); });
+    if (admission_waiter == data_w->m_admission.end())
+      return false;
+    erase_admission(data_w, admission_waiter);
+  }
+  // There might be room for a request that waits for admission now.
+  admit(data_w);
+  return true;
+}
+
+bool FileLockQueue::should_yield(clock_type::time_point deadline, std::chrono::nanoseconds max_wait) const
+{
+  clock_type::time_point const now = clock_type::now();
+  Data_ts::crat data_r(m_data);
+  auto urgent = [&](Waiter const& waiter){ return waiter.m_request.m_deadline < deadline || now - waiter.m_enqueued > max_wait; };
+  return std::any_of(data_r->m_waiters.begin(), data_r->m_waiters.end(), urgent) ||
+         std::any_of(data_r->m_admission.begin(), data_r->m_admission.end(),
+             [&urgent](admission_type::value_type const& entry){ return urgent(entry.second); });
+}
+
+std::map<FileLockQueue::group_id_type, FileLockQueue::GroupStatistics> FileLockQueue::statistics() const
+{
+  std::map<group_id_type, GroupStatistics> result;
+  Data_ts::crat data_r(m_data);
+  for (auto const& group : data_r->m_groups)
+    result.emplace(group.first, group.second.m_statistics);
+  return result;
+}
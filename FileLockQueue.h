@@ -0,0 +1,242 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class FileLockQueue.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "statefultask/AIStatefulTask.h"
+#include "threadsafe/threadsafe.h"
+#include "debug.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <vector>
+
+// class FileLockQueue
+//
+// The waiter queue of a FileLockSingleton, in front of its task mutex.
+//
+// A TaskLock first obtains a grant from this queue and only then locks the task mutex (which is
+// therefore normally free at that point). Only one task at a time has the grant; when it unlocks,
+// the grant is passed to the next waiter. Because the queue is ours, and not the (FIFO) queue of
+// AIStatefulTaskMutex, we can choose which waiter is next.
+//
+// Waiters are served by weighted fair queueing between groups (start-time fair queueing):
+// every request gets a start tag that is the maximum of the current virtual time and the finish tag
+// of the previous request of its group; its finish tag is the start tag plus 1/weight. The waiter
+// with the smallest start tag is served next and its start tag becomes the new virtual time.
+// As a result, a group that floods the queue only delays itself: every group with waiters gets
+// a share of the grants proportional to its weight. Within one group the order is FIFO, and when
+// all requests use the same group (the default), the queue is plain FIFO. The queue keeps the
+// fair queueing state and the statistics of every group id that it ever saw, so use a bounded
+// set of group ids (for example one per tenant), not one per request.
+//
+// Requests with a deadline take precedence over those without and are served in earliest-deadline-first
+// order. A waiter whose deadline passed is dropped from the queue (its task is signalled with the
+// Request::m_deadline_missed flag set) as soon as the deadline passes: the queue arms a DeadlineTimer for the
+// earliest deadline of its waiters. Because the waiters are kept ordered by deadline (and those waiting for
+// admission are indexed by deadline), finding the earliest deadline and the expired waiters costs O(log n).
+// Note that a steady stream of requests with a deadline starves those without one.
+//
+// Admission control: when a maximum queue depth is set (see FileLock::set_max_queue_depth) and that
+// many requests are waiting, the queue is saturated. New requests are then either rejected (fail fast)
+// or wait, first come first served, until there is room in the queue again (wait for admission);
+// the latter don't take part in the fair queueing until they are admitted. Producers can use
+// saturated(), or the saturation callback, to slow down.
+//
+class FileLockQueue
+{
+ public:
+  using clock_type = std::chrono::steady_clock;
+  using group_id_type = uint32_t;
+
+  // A request for the grant.
+  struct Request
+  {
+    AIStatefulTask* m_task;                             // The task to signal once the grant is obtained.
+    AIStatefulTask::condition_type m_condition;         // The condition to signal m_task with.
+    group_id_type m_group;                              // The group that the request belongs to.
+    uint32_t m_weight;                                  // The weight of that group (must be larger than zero).
+    clock_type::time_point m_deadline;                  // The time before which the grant must be obtained, or clock_type::time_point::max() if none.
+    bool* m_deadline_missed;                            // Set to true, before signalling m_task, if the request was dropped because of its deadline (may be nullptr).
+    bool m_fail_fast;                                   // Reject the request when the queue is saturated, instead of waiting for admission.
+  };
+
+  enum enqueue_result {
+    granted,                                            // The grant was obtained immediately.
+    queued,                                             // The request was queued; m_task will be signalled.
+    deadline_missed,                                    // The deadline of the request already passed; it was not queued.
+    rejected                                            // The queue is saturated and the request is fail fast; it was not queued.
+  };
+
+  // Type of the callback that is called when the queue becomes saturated (true) or no longer is (false).
+  using saturation_callback_type = std::function<void (bool saturated)>;
+
+  // Waiting time statistics of one group.
+  struct GroupStatistics
+  {
+    static constexpr int number_of_buckets = 40;        // Up to 2^40 ns, about 18 minutes.
+
+    uint64_t m_grants = 0;                              // The number of grants.
+    uint64_t m_deadline_misses = 0;                     // The number of requests that were dropped because they missed their deadline.
+    uint64_t m_rejections = 0;                          // The number of requests that were rejected because the queue was saturated.
+    std::chrono::nanoseconds m_total_wait{0};           // The sum of the waiting times.
+    std::chrono::nanoseconds m_max_wait{0};             // The longest waiting time.
+    std::array<uint64_t, number_of_buckets> m_histogram{};      // The number of waiting times w with 2^(i-1) <= w / 1ns < 2^i (i = 0 for w < 1 ns).
+
+    void add(std::chrono::nanoseconds wait);
+
+    // Return an upper bound of the waiting time that `fraction` (0...1) of the grants did not exceed, e.g. 0.99 for the 99th percentile.
+    std::chrono::nanoseconds percentile(double fraction) const;
+  };
+
+ private:
+  struct Waiter
+  {
+    Request m_request;
+    double m_start_tag;                                 // See the description of the class.
+    uint64_t m_sequence;                                // Breaks ties between equal start tags: first come first served.
+    clock_type::time_point m_enqueued;                  // The time at which the request was queued.
+  };
+
+  // The order in which waiters are served: earliest deadline first (requests without a deadline have
+  // time_point::max()), then by start tag, then first come first served.
+  struct ServeOrder
+  {
+    bool operator()(Waiter const& w1, Waiter const& w2) const
+    {
+      if (w1.m_request.m_deadline != w2.m_request.m_deadline)
+        return w1.m_request.m_deadline < w2.m_request.m_deadline;
+      if (w1.m_start_tag != w2.m_start_tag)
+        return w1.m_start_tag < w2.m_start_tag;
+      return w1.m_sequence < w2.m_sequence;
+    }
+  };
+
+  // The requests that wait for admission, by arrival number (first come first served).
+  using admission_type = std::map<uint64_t, Waiter>;
+
+  struct Group
+  {
+    double m_last_finish_tag = 0.0;                     // The finish tag of the last request of this group.
+    GroupStatistics m_statistics;
+  };
+
+  struct Data
+  {
+    bool m_granted = false;                             // Set while a task has the grant.
+    std::set<Waiter, ServeOrder> m_waiters;             // The queued requests, in the order in which they are served.
+    admission_type m_admission;                         // Requests that wait for room in m_waiters (not tagged yet).
+    std::set<std::pair<clock_type::time_point, uint64_t>> m_admission_deadlines;       // The deadlines of the requests in m_admission that have one, and their arrival number.
+    uint64_t m_last_arrival = 0;                        // The arrival number of the last request that had to wait for admission.
+    size_t m_max_depth = 0;                             // The maximum size of m_waiters, or 0 if unlimited.
+    bool m_saturated = false;                           // The last value passed to m_saturation_callback.
+    saturation_callback_type m_saturation_callback;
+    std::map<group_id_type, Group> m_groups;            // One entry per group id that was ever used (see the class comment).
+    double m_virtual_time = 0.0;                        // The start tag of the last request that was granted.
+    double m_max_start_tag = 0.0;                       // The largest start tag that was assigned so far.
+    uint64_t m_last_sequence = 0;
+    clock_type::time_point m_armed_deadline = clock_type::time_point::max();    // The deadline armed with DeadlineTimer, or max() if none.
+  };
+  using Data_ts = threadsafe::Unlocked<Data, threadsafe::policy::Primitive<std::mutex>>;
+
+  Data_ts m_data;
+
+ public:
+  ~FileLockQueue();
+
+  // Request the grant. If the result is `queued` then request.m_task is signalled with request.m_condition
+  // once it is granted (or dropped because it missed its deadline).
+  enqueue_result enqueue(Request const& request);
+
+  // Release the grant and pass it to the next waiter, if any.
+  void release();
+
+  // Pass the grant to the next waiter and queue request behind all current waiters (ignoring its deadline).
+  // Returns `granted` if there are no waiters (the grant is kept), otherwise `queued`.
+  // Only call this while having the grant.
+  enqueue_result requeue(Request const& request);
+
+  // Remove the queued request of task, if any, without signalling it. Returns true if a request was removed;
+  // false if task isn't queued (anymore): it has the grant then, was dropped, or was never queued.
+  bool remove(AIStatefulTask* task);
+
+  // Return true if a waiter has an earlier deadline than `deadline`, or waited longer than max_wait.
+  bool should_yield(clock_type::time_point deadline, std::chrono::nanoseconds max_wait) const;
+
+  // Return the number of waiters (not including the task that has the grant), including those waiting for admission.
+  size_t size() const
+  {
+    Data_ts::crat data_r(m_data);
+    return data_r->m_waiters.size() + data_r->m_admission.size();
+  }
+
+  // Set the maximum number of waiters, or 0 for unlimited (the default).
+  void set_max_depth(size_t max_depth);
+
+  // Return true if the queue is saturated: new requests are rejected or have to wait for admission.
+  bool saturated() const
+  {
+    Data_ts::crat data_r(m_data);
+    return is_saturated(data_r);
+  }
+
+  // Set a callback that is called whenever the queue becomes saturated, or stops being saturated.
+  // The callback is called while holding the mutex of the queue: it may not use this queue (but it can
+  // for example set a flag or signal a producer task).
+  void set_saturation_callback(saturation_callback_type saturation_callback)
+  {
+    Data_ts::wat(m_data)->m_saturation_callback = std::move(saturation_callback);
+  }
+
+  // Return a copy of the waiting time statistics of all groups.
+  std::map<group_id_type, GroupStatistics> statistics() const;
+
+  // Drop the waiters whose deadline passed. Called by DeadlineTimer.
+  void expire();
+
+ private:
+  // Assign the tags of a new request of group.
+  static void tag(Data_ts::wat const& data_w, Waiter& waiter);
+  // Add waiter to the requests that wait for admission.
+  static void push_admission(Data_ts::wat const& data_w, Waiter const& waiter);
+  // Remove a request that waits for admission.
+  static void erase_admission(Data_ts::wat const& data_w, admission_type::iterator waiter);
+  // Move the waiters whose deadline passed to dropped.
+  static void drop_expired(Data_ts::wat const& data_w, clock_type::time_point now, std::vector<Request>& dropped);
+  // Signal the dropped requests.
+  static void signal_dropped(std::vector<Request> const& dropped);
+  // Pass the grant to the best waiter and return its request (to be signalled). There must be at least one waiter.
+  Request pass_grant(Data_ts::wat const& data_w, clock_type::time_point now);
+  // Move requests that wait for admission to the queue while there is room, call the saturation callback if needed,
+  // and arm the DeadlineTimer for the earliest deadline of the waiters. Called after every change of the waiters.
+  void admit(Data_ts::wat const& data_w);
+  template<typename DATA>
+  static bool is_saturated(DATA const& data) { return data->m_max_depth > 0 && data->m_waiters.size() >= data->m_max_depth; }
+};
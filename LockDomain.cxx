@@ -0,0 +1,299 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class LockDomain.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "LockDomain.h"
+#include "PosixFileLockBackend.h"
+#include <fstream>
+#include <iomanip>
+#include <vector>
+
+namespace {
+
+// The domain that registered each lock file (by lock owner and inode), over all domains; see get_instance.
+using lock_file_id_type = std::pair<void const*, FileLockSingleton::inode_id_type>;
+using lock_file_domains_ts = threadsafe::Unlocked<std::map<lock_file_id_type, LockDomain const*>, threadsafe::policy::Primitive<std::mutex>>;
+
+lock_file_domains_ts& lock_file_domains()
+{
+  // Never destroyed, like the default domain.
+  static lock_file_domains_ts* s_lock_file_domains = new lock_file_domains_ts;
+  return *s_lock_file_domains;
+}
+
+} // namespace
+
+LockDomain::LockDomain() : m_number_of_handles(0)
+{
+  for (auto& chunk : m_chunks)
+    chunk.store(nullptr, std::memory_order_relaxed);
+}
+
+LockDomain::~LockDomain()
+{
+  file_lock_map_ts::wat file_lock_map_w(m_file_lock_map);
+  // Release the file locks that were only kept alive by their handle.
+  for (uint32_t c = 0; c < max_chunks; ++c)
+    delete m_chunks[c].load(std::memory_order_relaxed);
+  for (auto iter = file_lock_map_w->m_by_path.begin(); iter != file_lock_map_w->m_by_path.end();)
+  {
+    if (iter->use_count() > 1)
+    {
+      ++iter;
+      continue;
+    }
+    lock_file_domains_ts::wat(lock_file_domains())->erase({file_lock_map_w->m_backend->lock_owner(), (*iter)->m_inode_id});
+    file_lock_map_w->m_by_inode.erase((*iter)->m_inode_id);
+    iter = file_lock_map_w->m_by_path.erase(iter);
+  }
+  // Destroy all FileLock objects of a domain before destroying the domain.
+  ASSERT(file_lock_map_w->m_by_path.empty());
+}
+
+//static
+LockDomain& LockDomain::default_domain()
+{
+  // Never destroyed: global FileLock objects might be destructed after it otherwise.
+  static LockDomain* s_default_domain = new LockDomain;
+  return *s_default_domain;
+}
+
+void LockDomain::set_backend(std::shared_ptr<FileLockBackend> backend)
+{
+  // Don't pass a nullptr.
+  ASSERT(backend);
+  file_lock_map_ts::wat file_lock_map_w(m_file_lock_map);
+  // Only change the backend while no lock files are in use.
+  ASSERT(file_lock_map_w->m_by_path.empty());
+  // The cache contains inodes of another backend.
+  file_lock_map_w->m_cache.clear();
+  file_lock_map_w->m_backend = std::move(backend);
+}
+
+std::shared_ptr<FileLockSingleton> LockDomain::get_instance(std::filesystem::path const& normal_path)
+{
+  file_lock_map_ts::wat file_lock_map_w(m_file_lock_map);
+  Statistics& statistics = file_lock_map_w->m_statistics;
+  ++statistics.m_lookups;
+
+  if (!file_lock_map_w->m_backend)
+    file_lock_map_w->m_backend = std::make_shared<PosixFileLockBackend>();
+  FileLockBackend& backend = *file_lock_map_w->m_backend;
+
+  // Look if we already have a FileLock with the same path.
+  auto by_path = file_lock_map_w->m_by_path.find(normal_path);
+  if (by_path != file_lock_map_w->m_by_path.end())
+  {
+    ++statistics.m_path_hits;
+    return *by_path;
+  }
+
+  // Return the FileLockSingleton of inode_id, if we have one.
+  auto find_by_inode = [&](FileLockSingleton::inode_id_type const& inode_id) -> std::shared_ptr<FileLockSingleton> {
+    auto by_inode = file_lock_map_w->m_by_inode.find(inode_id);
+    if (by_inode == file_lock_map_w->m_by_inode.end())
+      return {};
+    auto iter = file_lock_map_w->m_by_path.find(by_inode->second->canonical_path());
+    ASSERT(iter != file_lock_map_w->m_by_path.end());
+    ++statistics.m_inode_hits;
+    return *iter;
+  };
+
+  // Different domains may not use the same lock file (see LockDomain).
+  auto check_not_in_other_domain = [&](FileLockSingleton::inode_id_type const& inode_id) {
+    lock_file_domains_ts::rat lock_file_domains_r(lock_file_domains());
+    if (lock_file_domains_r->find(lock_file_id_type{backend.lock_owner(), inode_id}) != lock_file_domains_r->end())
+      THROW_ALERT("The lock file [FILENAME] is already used by another LockDomain.", AIArgs("[FILENAME]", normal_path));
+  };
+
+  // Look if we already have a FileLock with an equivalent path (the same inode).
+  // If the inode was verified by load_registry_cache, use that; otherwise stat the file.
+  FileLockSingleton::inode_id_type inode_id;
+  bool have_inode_id = false;
+  auto cached = file_lock_map_w->m_cache.find(normal_path);
+  if (cached != file_lock_map_w->m_cache.end())
+  {
+    ++statistics.m_cache_hits;
+    inode_id = cached->second;
+    have_inode_id = true;
+    // A cache entry is only used once: the file can be replaced at any time after it was verified.
+    file_lock_map_w->m_cache.erase(cached);
+  }
+  else
+    have_inode_id = backend.stat(normal_path, inode_id);
+  if (have_inode_id)
+  {
+    if (auto file_lock_instance = find_by_inode(inode_id))
+      return file_lock_instance;
+    // Check this before opening the lock file: closing it again would release the lock of the other domain.
+    check_not_in_other_domain(inode_id);
+  }
+
+  // This file is not in our map. Add it.
+  std::unique_ptr<FileLockBackend::LockFile> lock_file = backend.open(normal_path);
+  // Use the inode of the file that is actually open. It differs from the cached (or stat-ed) one when the file
+  // was created just now, or was replaced in the meantime - possibly by one that we already have.
+  if (!have_inode_id || lock_file->inode_id() != inode_id)
+  {
+    inode_id = lock_file->inode_id();
+    if (auto file_lock_instance = find_by_inode(inode_id))
+      return file_lock_instance;
+    check_not_in_other_domain(inode_id);
+  }
+  auto res = file_lock_map_w->m_by_path.emplace(new FileLockSingleton(normal_path, std::move(lock_file)));
+  ASSERT(res.second);
+  FileLockSingleton* file_lock_singleton = res.first->get();
+  file_lock_singleton->m_inode_id = inode_id;
+  file_lock_map_w->m_by_inode.emplace(inode_id, file_lock_singleton);
+  lock_file_domains_ts::wat(lock_file_domains())->emplace(lock_file_id_type{backend.lock_owner(), inode_id}, this);
+  ++statistics.m_created;
+  statistics.m_registered = file_lock_map_w->m_by_path.size();
+
+  // Note: our canonical means that it is the name stored in m_file_lock_map for that inode.
+  // However it can contain symbolic links: it is merely the (lexically normalized) path that
+  // was passed (first) to set_filename(). Lexically normalized means that occurances of '.'
+  // and '..' where removed from the path, but not symbolic links, if any. Boost filesystem
+  // also uses the word 'canonical' in which case they also remove symbolic links, but that
+  // is not how we use it.
+  return *res.first;
+}
+
+void LockDomain::release_instance(std::shared_ptr<FileLockSingleton> const& file_lock_instance)
+{
+  file_lock_map_ts::wat file_lock_map_w(m_file_lock_map);
+  auto iter = file_lock_map_w->m_by_path.find(file_lock_instance->canonical_path());
+  // Destroy a FileLock before the LockDomain that it belongs to.
+  ASSERT(iter != file_lock_map_w->m_by_path.end());
+  // The one in the std::set and the one of the FileLock that is being destructed; a file lock with a handle is kept.
+  if (iter->use_count() == 2 && file_lock_instance->m_handle_index.load(std::memory_order_relaxed) == LockHandle::invalid_index)
+  {
+    // Do not destruct the last FileLock object that refers to a given FileLockSingleton
+    // (aka, canonical path of a file lock) while a FileLockAccess object for that still exists.
+    // That includes therefore AIStatefulTaskNamedMutex and AIStatefulTaskLockTask objects.
+    ASSERT(FileLockSingleton::Data_ts::rat(iter->get()->m_data)->m_number_of_FileLockAccess_objects == 0);
+    lock_file_domains_ts::wat(lock_file_domains())->erase({file_lock_map_w->m_backend->lock_owner(), file_lock_instance->m_inode_id});
+    file_lock_map_w->m_by_inode.erase(file_lock_instance->m_inode_id);
+    file_lock_map_w->m_by_path.erase(iter);
+    file_lock_map_w->m_statistics.m_registered = file_lock_map_w->m_by_path.size();
+  }
+}
+
+LockHandle LockDomain::handle(FileLock const& file_lock)
+{
+  // The FileLock must belong to this domain.
+  ASSERT(&file_lock.domain() == this);
+  std::shared_ptr<FileLockSingleton> const& file_lock_instance = file_lock.get_instance();
+  uint32_t index = file_lock_instance->m_handle_index.load(std::memory_order_acquire);
+  if (index != LockHandle::invalid_index)
+    return LockHandle{index};
+
+  // Assign a new slot while holding the registry lock; this also serializes the assignment of slots.
+  file_lock_map_ts::wat file_lock_map_w(m_file_lock_map);
+  index = file_lock_instance->m_handle_index.load(std::memory_order_relaxed);
+  if (index != LockHandle::invalid_index)
+    return LockHandle{index};   // Another thread was first.
+  index = m_number_of_handles.load(std::memory_order_relaxed);
+  auto const [chunk_index, offset] = locate(index);
+  if (chunk_index == max_chunks)
+    THROW_ALERT("Too many lock handles (maximum is [MAX]).", AIArgs("[MAX]", first_chunk_size << (max_chunks - 1)));
+  SlotChunk* chunk = m_chunks[chunk_index].load(std::memory_order_relaxed);
+  if (!chunk)
+  {
+    chunk = new SlotChunk(chunk_size(chunk_index));
+    m_chunks[chunk_index].store(chunk, std::memory_order_release);
+  }
+  chunk->m_instances[offset] = file_lock_instance.get();
+  chunk->m_owners[offset] = file_lock_instance;
+  m_number_of_handles.store(index + 1, std::memory_order_release);
+  file_lock_instance->m_handle_index.store(index, std::memory_order_release);
+  return LockHandle{index};
+}
+
+void LockDomain::load_registry_cache(std::filesystem::path const& cache_filename)
+{
+  DoutEntering(dc::notice, "LockDomain::load_registry_cache(" << cache_filename << ")");
+  std::ifstream cache_file(cache_filename);
+  if (!cache_file)
+  {
+    Dout(dc::notice, "No registry cache " << cache_filename << ".");
+    return;
+  }
+  // Read all entries.
+  std::vector<std::pair<std::filesystem::path, FileLockSingleton::inode_id_type>> entries;
+  unsigned long long device, inode;
+  std::string canonical_path;
+  while (cache_file >> device >> inode >> std::quoted(canonical_path))
+  {
+    std::filesystem::path path(canonical_path);
+    if (!path.is_absolute() || path != path.lexically_normal() || !path.has_filename())
+      break;    // Corrupt.
+    entries.emplace_back(path, FileLockSingleton::inode_id_type(device, inode));
+  }
+  if (!cache_file.eof())
+    Dout(dc::warning, "Registry cache " << cache_filename << " is corrupt; ignoring the rest.");
+
+  std::shared_ptr<FileLockBackend> backend;
+  {
+    file_lock_map_ts::wat file_lock_map_w(m_file_lock_map);
+    if (!file_lock_map_w->m_backend)
+      file_lock_map_w->m_backend = std::make_shared<PosixFileLockBackend>();
+    backend = file_lock_map_w->m_backend;
+  }
+
+  // Verify the entries (without holding m_file_lock_map).
+  backend->verify(entries);
+  std::map<std::filesystem::path, FileLockSingleton::inode_id_type> verified(entries.begin(), entries.end());
+  Dout(dc::notice, "Loaded " << verified.size() << " verified entries from registry cache " << cache_filename << ".");
+
+  file_lock_map_ts::wat file_lock_map_w(m_file_lock_map);
+  file_lock_map_w->m_cache.merge(verified);
+}
+
+void LockDomain::save_registry_cache(std::filesystem::path const& cache_filename)
+{
+  DoutEntering(dc::notice, "LockDomain::save_registry_cache(" << cache_filename << ")");
+  // Write to a temporary file first, so that a concurrently starting process never reads half a cache.
+  std::filesystem::path temporary_filename = cache_filename;
+  temporary_filename += ".tmp";
+  {
+    std::ofstream cache_file(temporary_filename);
+    if (!cache_file)
+      THROW_ALERTE("Failed to create registry cache [FILENAME].", AIArgs("[FILENAME]", temporary_filename));
+    file_lock_map_ts::rat file_lock_map_r(m_file_lock_map);
+    std::map<std::filesystem::path, FileLockSingleton::inode_id_type> entries = file_lock_map_r->m_cache;
+    for (auto const& file_lock_singleton : file_lock_map_r->m_by_path)
+      entries[file_lock_singleton->canonical_path()] = file_lock_singleton->m_inode_id;
+    for (auto const& entry : entries)
+      cache_file << entry.second.first << ' ' << entry.second.second << ' ' << std::quoted(entry.first.native()) << '\n';
+    if (!cache_file.flush())
+      THROW_ALERTE("Failed to write registry cache [FILENAME].", AIArgs("[FILENAME]", temporary_filename));
+  }
+  std::error_code error_code;
+  std::filesystem::rename(temporary_filename, cache_filename, error_code);
+  if (error_code)
+    THROW_ALERTC(error_code.value(), "Failed to rename [FROM] to [TO].", AIArgs("[FROM]", temporary_filename)("[TO]", cache_filename));
+}
@@ -0,0 +1,234 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class LockDomain.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "FileLock.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <utility>
+
+// A registry of file locks.
+//
+// Every FileLock belongs to a LockDomain: the one passed to its constructor, or the default domain.
+// A domain has its own registry of FileLockSingleton objects (by canonical path and by inode, see
+// FileLock), its own mutex, backend (see set_backend), registry cache (see load_registry_cache)
+// and statistics. Hence subsystems that use their own domain don't contend with each other on
+// the registry, and a domain (for example, one per test) can be destroyed as a whole.
+//
+// Not everything is per domain though: the PathLockTree (see PathLockTree::instance) and the
+// DeadlineTimer (see DeadlineTimer::instance) are process-wide. TaskLocks and SubtreeLocks of all
+// domains therefore still share the mutex of the path tree, and FileLockQueue deadlines of all domains
+// are handled by the same timer thread. Moreover, since the path tree only knows canonical paths,
+// equal paths of different domains (for example, with different fake backends) exclude each other there.
+//
+// Different domains must not use the same lock file (an equivalent path with a backend that has the same
+// lock owner, see FileLockBackend::lock_owner). OS file locks belong to the process: two domains would not
+// exclude each other, and closing the lock file in one domain would release the lock held by the other.
+// Therefore FileLock::set_filename throws when the lock file is already used by another domain.
+//
+// A LockDomain must outlive all FileLock objects that belong to it. The default domain is never
+// destroyed, so that global FileLock objects can be destructed in any order.
+//
+// Usage:
+//
+//   LockDomain domain(std::make_shared<FakeFileLockBackend>(file_system, 1));
+//   FileLock file_lock(domain, "/locks/a.lock");
+//
+class LockDomain
+{
+ public:
+  // Counters of a domain (see statistics()).
+  struct Statistics
+  {
+    size_t m_registered = 0;            // The number of FileLockSingleton objects that currently exist.
+    uint64_t m_lookups = 0;             // The number of calls to FileLock::set_filename.
+    uint64_t m_path_hits = 0;           // Lookups that found an existing file lock with the same path.
+    uint64_t m_inode_hits = 0;          // Lookups that found an existing file lock with an equivalent path.
+    uint64_t m_cache_hits = 0;          // Lookups that used the inode from the registry cache (no stat needed).
+    uint64_t m_created = 0;             // Lookups that opened a new lock file.
+  };
+
+ private:
+  struct CanonicalPathCompare
+  {
+    bool operator()(std::shared_ptr<FileLockSingleton> const& p1, std::shared_ptr<FileLockSingleton> const& p2) const
+    {
+      // This compares if the paths have the same string representation.
+      // Therefore it must be guaranteed in somewhere else that a new path is
+      // not equivalent (doesn't resolve to the same actual file) before adding
+      // it to the set!
+      return p1->canonical_path() < p2->canonical_path();
+    }
+    // Allow direct comparision with std::filesystem::path.
+    using is_transparent = std::true_type;
+    bool operator()(std::filesystem::path const& canonical_path, std::shared_ptr<FileLockSingleton> const& p2) const
+    {
+      return canonical_path < p2->canonical_path();
+    }
+    bool operator()(std::shared_ptr<FileLockSingleton> const& p1, std::filesystem::path const& canonical_path) const
+    {
+      return p1->canonical_path() < canonical_path;
+    }
+  };
+  struct FileLockMap
+  {
+    std::set<std::shared_ptr<FileLockSingleton>, CanonicalPathCompare> m_by_path;      // All file locks by canonical path.
+    std::map<FileLockSingleton::inode_id_type, FileLockSingleton*> m_by_inode;         // The same file locks by inode.
+    std::map<std::filesystem::path, FileLockSingleton::inode_id_type> m_cache;          // Verified inodes of canonical paths, see load_registry_cache.
+    std::shared_ptr<FileLockBackend> m_backend;                                         // The backend used for new lock files, see set_backend.
+    Statistics m_statistics;                                                            // See statistics().
+  };
+  using file_lock_map_ts = threadsafe::Unlocked<FileLockMap, threadsafe::policy::Primitive<std::mutex>>;
+  file_lock_map_ts m_file_lock_map;                             // All file locks of this domain by canonical path.
+
+  // The slot table of the handles (see handle()).
+  //
+  // Slots are allocated in chunks that are never moved or freed before the domain is destroyed,
+  // so that a slot can be accessed without locking m_file_lock_map. The first chunk is small; every
+  // next chunk is as large as all previous chunks together, so that a domain with few handles uses
+  // little memory and the chunk of a handle can still be found in O(1) (see locate).
+  static constexpr int log2_first_chunk_size = 6;
+  static constexpr uint32_t first_chunk_size = 1 << log2_first_chunk_size;
+  static constexpr uint32_t max_chunks = 26;                    // Allows first_chunk_size << (max_chunks - 1) = 2^31 handles.
+  struct SlotChunk
+  {
+    std::unique_ptr<FileLockSingleton*[]> m_instances;                  // The FileLockSingleton of each handle; this is what a scan walks over.
+    std::unique_ptr<std::shared_ptr<FileLockSingleton>[]> m_owners;     // Keeps the FileLockSingleton alive for the lifetime of the domain.
+
+    explicit SlotChunk(uint32_t size) : m_instances(new FileLockSingleton*[size]), m_owners(new std::shared_ptr<FileLockSingleton>[size]) { }
+  };
+  std::array<std::atomic<SlotChunk*>, max_chunks> m_chunks;     // The allocated chunks, followed by nullptr's.
+  std::atomic<uint32_t> m_number_of_handles;                    // The number of slots in use.
+
+  // Return the number of slots of chunk chunk_index.
+  static uint32_t chunk_size(uint32_t chunk_index) { return chunk_index == 0 ? first_chunk_size : first_chunk_size << (chunk_index - 1); }
+
+  // Return the index of the chunk of the slot with index `index`, and the offset of the slot in that chunk.
+  static std::pair<uint32_t, uint32_t> locate(uint32_t index)
+  {
+    // Chunk 0 contains the slots [0, first_chunk_size); chunk c > 0 the slots [first_chunk_size << (c - 1), first_chunk_size << c).
+    uint32_t const first_chunk_sizes = index >> log2_first_chunk_size;
+    if (first_chunk_sizes == 0)
+      return {0, index};
+    uint32_t const msb = 31 - __builtin_clz(first_chunk_sizes);
+    return {msb + 1, index - (first_chunk_size << msb)};
+  }
+
+ public:
+  // Construct a domain that uses PosixFileLockBackend (real files).
+  LockDomain();
+  // Construct a domain that uses backend.
+  LockDomain(std::shared_ptr<FileLockBackend> backend) : LockDomain() { set_backend(std::move(backend)); }
+  ~LockDomain();
+
+  LockDomain(LockDomain const&) = delete;
+  LockDomain& operator=(LockDomain const&) = delete;
+
+  // The domain of FileLock objects that were constructed without one.
+  static LockDomain& default_domain();
+
+  // Set the backend through which lock files are accessed.
+  //
+  // The default is PosixFileLockBackend (real files). Tests and benchmarks can install a
+  // FakeFileLockBackend instead, to run without touching the disk; with an injected latency
+  // and with several backends (simulated processes) on the same FakeFileSystem.
+  //
+  // This may only be called while no FileLock of this domain has a filename (e.g. at the start of main()).
+  void set_backend(std::shared_ptr<FileLockBackend> backend);
+
+  // Registry cache.
+  //
+  // Programs that call set_filename for the same (large number of) paths every time they start can
+  // save the canonical paths and inodes of all file locks with save_registry_cache before exiting and
+  // load them with load_registry_cache at the start of the next run, before calling set_filename.
+  // Loading checks every entry with the backend (the POSIX backend does a single fstatat relative to its
+  // (once opened) directory per entry);
+  // entries whose lock file was removed or recreated (has a different inode) are dropped. After that
+  // set_filename doesn't need to stat the paths that were found in the cache.
+  //
+  // A missing or corrupt cache file is not an error: the registry then falls back to stat-ing every path.
+  void load_registry_cache(std::filesystem::path const& cache_filename);
+  void save_registry_cache(std::filesystem::path const& cache_filename);
+
+  // Dense lock handles.
+  //
+  // handle returns the LockHandle of the file lock of file_lock (which must belong to this domain and have
+  // a filename). The first call for a given file lock assigns it the next free slot; subsequent calls (also
+  // through other FileLock objects with an equivalent path) return the same handle without locking the
+  // registry. From then on the file lock stays registered until the domain is destroyed, even after all
+  // FileLock objects that refer to it are gone. Therefore only use handles for a long-lived, bounded set of
+  // file locks (for example, those that are scanned over and over again); not for file locks that come and go.
+  //
+  // instance returns the file lock of a handle in O(1), without touching a reference count, and
+  // number_of_handles the number of handles that were given out: the valid handles are 0 through
+  // number_of_handles() - 1. For example, to scan all handles:
+  //
+  //   for (uint32_t index = 0; index < domain.number_of_handles(); ++index)
+  //     if (domain.instance(LockHandle{index}).is_self_locked(task))
+  //       ...
+  //
+  // A FileLockAccess can be created from a handle too.
+  LockHandle handle(FileLock const& file_lock);
+
+  FileLockSingleton& instance(LockHandle handle) const
+  {
+    // Only pass handles that were returned by handle() of this domain.
+    ASSERT(handle.index() < m_number_of_handles.load(std::memory_order_acquire));
+    auto [chunk_index, offset] = locate(handle.index());
+    SlotChunk const* chunk = m_chunks[chunk_index].load(std::memory_order_acquire);
+    return *chunk->m_instances[offset];
+  }
+
+  uint32_t number_of_handles() const { return m_number_of_handles.load(std::memory_order_acquire); }
+
+  // Return a copy of the counters of this domain.
+  Statistics statistics() const
+  {
+    return file_lock_map_ts::crat(m_file_lock_map)->m_statistics;
+  }
+
+ private:
+  friend class FileLock;
+  friend class FileLockAccess;
+  // Return the owning pointer of the file lock of handle (used for debugging by FileLockAccess).
+  std::shared_ptr<FileLockSingleton> const& owner(LockHandle handle) const
+  {
+    ASSERT(handle.index() < m_number_of_handles.load(std::memory_order_acquire));
+    auto [chunk_index, offset] = locate(handle.index());
+    SlotChunk const* chunk = m_chunks[chunk_index].load(std::memory_order_acquire);
+    return chunk->m_owners[offset];
+  }
+  // Return the FileLockSingleton of normal_path (an absolute, lexically normal path), creating it if it doesn't exist yet.
+  std::shared_ptr<FileLockSingleton> get_instance(std::filesystem::path const& normal_path);
+  // Called by the destructor of FileLock: remove file_lock_instance from the registry if this FileLock is the last one referring to it.
+  void release_instance(std::shared_ptr<FileLockSingleton> const& file_lock_instance);
+};
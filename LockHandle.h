@@ -0,0 +1,60 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class LockHandle.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+
+// A dense 32-bit handle of a file lock.
+//
+// A LockHandle is an index into the slot table of a LockDomain (see LockDomain::handle): copying and
+// comparing handles doesn't touch any reference count, and iterating over all handles of a domain
+// walks a contiguous table. The handle is only meaningful together with its domain, and stays valid
+// for the lifetime of that domain.
+//
+class LockHandle
+{
+ public:
+  static constexpr uint32_t invalid_index = std::numeric_limits<uint32_t>::max();
+
+ private:
+  uint32_t m_index;
+
+ public:
+  // Construct an invalid handle.
+  LockHandle() : m_index(invalid_index) { }
+  explicit LockHandle(uint32_t index) : m_index(index) { }
+
+  // Accessors.
+  uint32_t index() const { return m_index; }
+  bool is_valid() const { return m_index != invalid_index; }
+
+  friend bool operator==(LockHandle h1, LockHandle h2) { return h1.m_index == h2.m_index; }
+  friend bool operator!=(LockHandle h1, LockHandle h2) { return h1.m_index != h2.m_index; }
+  friend bool operator<(LockHandle h1, LockHandle h2) { return h1.m_index < h2.m_index; }
+};
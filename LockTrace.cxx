@@ -0,0 +1,409 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class LockTrace.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "LockTrace.h"
+#include "utils/AIAlert.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+void append_number(std::vector<uint8_t>& buffer, uint64_t number)
+{
+  // Unsigned LEB128.
+  while (number >= 0x80)
+  {
+    buffer.push_back(static_cast<uint8_t>(number | 0x80));
+    number >>= 7;
+  }
+  buffer.push_back(static_cast<uint8_t>(number));
+}
+
+void append_string(std::vector<uint8_t>& buffer, std::string const& str)
+{
+  append_number(buffer, str.size());
+  buffer.insert(buffer.end(), str.begin(), str.end());
+}
+
+uint64_t nanoseconds_between(LockTrace::clock_type::time_point from, LockTrace::clock_type::time_point to)
+{
+  return to > from ? std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count() : 0;
+}
+
+// The size at which the buffer of a thread is handed over to the shared buffer.
+constexpr size_t thread_flush_size = 4096;
+// The size at which the shared buffer is written to the trace file.
+constexpr size_t flush_size = 65536;
+
+} // namespace
+
+//static
+constexpr char LockTrace::magic[8];
+//static
+LockTrace::Data_ts LockTrace::s_data;
+//static
+std::mutex LockTrace::s_file_mutex;
+//static
+std::atomic<uint32_t> LockTrace::s_recording_session;
+//static
+std::atomic<LockTrace::clock_type::rep> LockTrace::s_start;
+//static
+std::atomic<uint32_t> LockTrace::s_last_request_id;
+
+LockTrace::ThreadState::ThreadState()
+{
+  Data_ts::wat(s_data)->m_threads.push_back(this);
+}
+
+LockTrace::ThreadState::~ThreadState()
+{
+  Data_ts::wat data_w(s_data);
+  data_w->m_threads.erase(std::find(data_w->m_threads.begin(), data_w->m_threads.end(), this));
+  // Hand over the events of this thread; they are written by the next hand_over or by stop().
+  ThreadBuffer_ts::wat buffer_w(m_buffer);
+  uint32_t const session = s_recording_session.load(std::memory_order_relaxed);
+  if (session != 0 && buffer_w->m_session == session)
+    data_w->m_buffer.insert(data_w->m_buffer.end(), buffer_w->m_buffer.begin(), buffer_w->m_buffer.end());
+}
+
+//static
+LockTrace::ThreadState& LockTrace::thread_state()
+{
+  static thread_local ThreadState s_thread_state;
+  return s_thread_state;
+}
+
+//static
+void LockTrace::start(std::filesystem::path const& filename)
+{
+  DoutEntering(dc::notice, "LockTrace::start(" << filename << ")");
+  Data_ts::wat data_w(s_data);
+  // Don't start a recording twice.
+  ASSERT(!data_w->m_file);
+  data_w->m_file = std::fopen(filename.c_str(), "wb");
+  if (!data_w->m_file)
+    THROW_ALERTE("Failed to create lock trace [FILENAME].", AIArgs("[FILENAME]", filename));
+  data_w->m_buffer.assign(magic, magic + sizeof(magic));
+  data_w->m_lock_ids.clear();
+  data_w->m_task_types.clear();
+  s_start.store(clock_type::now().time_since_epoch().count(), std::memory_order_relaxed);
+  s_last_request_id.store(0, std::memory_order_relaxed);
+  if (++data_w->m_session == 0)         // Skip 0, which means 'not recording'.
+    data_w->m_session = 1;
+  // The events of threads that still have a buffer of a previous session are dropped (see add_event).
+  s_recording_session.store(data_w->m_session, std::memory_order_release);
+}
+
+//static
+void LockTrace::stop()
+{
+  DoutEntering(dc::notice, "LockTrace::stop()");
+  Data_ts::wat data_w(s_data);
+  if (!data_w->m_file)
+    return;
+  // This is 0 if writing the trace failed.
+  uint32_t const session = s_recording_session.exchange(0, std::memory_order_relaxed);
+  // Collect the events that are still in the buffers of the threads.
+  for (ThreadState* thread_state : data_w->m_threads)
+  {
+    ThreadBuffer_ts::wat buffer_w(thread_state->m_buffer);
+    if (session != 0 && buffer_w->m_session == session)
+      data_w->m_buffer.insert(data_w->m_buffer.end(), buffer_w->m_buffer.begin(), buffer_w->m_buffer.end());
+    buffer_w->m_buffer.clear();
+  }
+  // Wait for a hand_over that is still writing.
+  std::lock_guard<std::mutex> file_lock(s_file_mutex);
+  if (session != 0)
+    write(data_w->m_file, data_w->m_buffer);
+  data_w->m_buffer.clear();
+  if (std::fclose(data_w->m_file) != 0)
+    Dout(dc::warning, "Failed to close lock trace!");
+  data_w->m_file = nullptr;
+}
+
+//static
+bool LockTrace::get_id(ThreadState& thread_state, uint32_t session, std::string const& name, bool is_lock, uint32_t& id, bool& is_new)
+{
+  if (thread_state.m_session != session)
+  {
+    // The ids of a previous recording.
+    thread_state.m_lock_ids.clear();
+    thread_state.m_task_types.clear();
+    thread_state.m_session = session;
+  }
+  std::map<std::string, uint32_t>& cache = is_lock ? thread_state.m_lock_ids : thread_state.m_task_types;
+  auto iter = cache.find(name);
+  if (iter != cache.end())
+  {
+    id = iter->second;
+    is_new = false;
+    return true;
+  }
+  {
+    Data_ts::wat data_w(s_data);
+    if (s_recording_session.load(std::memory_order_relaxed) != session)
+      return false;     // Recording was stopped in the meantime.
+    std::map<std::string, uint32_t>& ids = is_lock ? data_w->m_lock_ids : data_w->m_task_types;
+    auto res = ids.emplace(name, ids.size());
+    id = res.first->second;
+    // The thread that added the id writes its name.
+    is_new = res.second;
+  }
+  cache.emplace(name, id);
+  return true;
+}
+
+//static
+void LockTrace::add_event(ThreadBuffer_ts::wat const& buffer_w, uint32_t session, record_type type, clock_type::time_point now)
+{
+  if (buffer_w->m_session != session)
+  {
+    // Drop the events of a previous recording.
+    buffer_w->m_buffer.clear();
+    buffer_w->m_session = session;
+  }
+  if (buffer_w->m_buffer.empty())
+  {
+    // Start a new chunk.
+    clock_type::time_point const start{clock_type::duration{s_start.load(std::memory_order_relaxed)}};
+    buffer_w->m_buffer.push_back(chunk_record);
+    append_number(buffer_w->m_buffer, nanoseconds_between(start, now));
+    buffer_w->m_last_event = now;
+  }
+  buffer_w->m_buffer.push_back(type);
+  append_number(buffer_w->m_buffer, nanoseconds_between(buffer_w->m_last_event, now));
+  buffer_w->m_last_event = now;
+}
+
+//static
+void LockTrace::hand_over(std::vector<uint8_t>& chunk, uint32_t session)
+{
+  std::vector<uint8_t> buffer;
+  std::FILE* file;
+  std::unique_lock<std::mutex> file_lock;
+  {
+    Data_ts::wat data_w(s_data);
+    // Drop the events if recording was stopped (or restarted) in the meantime.
+    if (s_recording_session.load(std::memory_order_relaxed) != session)
+      return;
+    data_w->m_buffer.insert(data_w->m_buffer.end(), chunk.begin(), chunk.end());
+    if (data_w->m_buffer.size() < flush_size)
+      return;
+    buffer.swap(data_w->m_buffer);
+    file = data_w->m_file;
+    // Lock the file before unlocking s_data: this keeps the writes in order, and stop() waits for us.
+    file_lock = std::unique_lock<std::mutex>(s_file_mutex);
+  }
+  // Write without blocking the other threads that hand over their events.
+  write(file, buffer);
+}
+
+//static
+void LockTrace::write(std::FILE* file, std::vector<uint8_t> const& buffer)
+{
+  if (std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+  {
+    // Don't keep recording into a file that is missing events.
+    Dout(dc::warning, "Failed to write lock trace: " << std::strerror(errno) << "; recording stopped.");
+    s_recording_session.store(0, std::memory_order_relaxed);
+  }
+}
+
+//static
+void LockTrace::request(Ticket& ticket, std::filesystem::path const& canonical_path, char const* task_type)
+{
+  uint32_t const session = s_recording_session.load(std::memory_order_acquire);
+  if (session == 0)
+    return;     // Recording was stopped in the meantime.
+  ThreadState& state = thread_state();
+  uint32_t lock_id, task_type_id;
+  bool new_lock_id, new_task_type;
+  if (!get_id(state, session, canonical_path.native(), true, lock_id, new_lock_id) ||
+      !get_id(state, session, task_type, false, task_type_id, new_task_type))
+    return;
+  ticket.m_session = session;
+  ticket.m_request_id = s_last_request_id.fetch_add(1, std::memory_order_relaxed) + 1;
+
+  std::vector<uint8_t> chunk;
+  {
+    ThreadBuffer_ts::wat buffer_w(state.m_buffer);
+    add_event(buffer_w, session, request_record, clock_type::now());
+    append_number(buffer_w->m_buffer, ticket.m_request_id);
+    append_number(buffer_w->m_buffer, lock_id);
+    append_number(buffer_w->m_buffer, task_type_id);
+    // The names follow the first request that uses them.
+    if (new_lock_id)
+    {
+      buffer_w->m_buffer.push_back(lock_name_record);
+      append_number(buffer_w->m_buffer, lock_id);
+      append_string(buffer_w->m_buffer, canonical_path.native());
+    }
+    if (new_task_type)
+    {
+      buffer_w->m_buffer.push_back(task_type_name_record);
+      append_number(buffer_w->m_buffer, task_type_id);
+      append_string(buffer_w->m_buffer, task_type);
+    }
+    if (buffer_w->m_buffer.size() >= thread_flush_size)
+      chunk.swap(buffer_w->m_buffer);
+  }
+  if (!chunk.empty())
+    hand_over(chunk, session);
+}
+
+//static
+void LockTrace::acquire(Ticket& ticket)
+{
+  uint32_t const session = s_recording_session.load(std::memory_order_acquire);
+  // Ignore requests of another (or no) recording session.
+  if (ticket.m_session == 0 || ticket.m_session != session)
+    return;
+  ticket.m_acquired = clock_type::now();
+  std::vector<uint8_t> chunk;
+  {
+    ThreadBuffer_ts::wat buffer_w(thread_state().m_buffer);
+    add_event(buffer_w, session, acquire_record, ticket.m_acquired);
+    append_number(buffer_w->m_buffer, ticket.m_request_id);
+    if (buffer_w->m_buffer.size() >= thread_flush_size)
+      chunk.swap(buffer_w->m_buffer);
+  }
+  if (!chunk.empty())
+    hand_over(chunk, session);
+}
+
+//static
+void LockTrace::release(Ticket& ticket)
+{
+  uint32_t const session = s_recording_session.load(std::memory_order_acquire);
+  if (ticket.m_session == 0 || ticket.m_session != session)
+    return;
+  ticket.m_session = 0;
+  clock_type::time_point const now = clock_type::now();
+  std::vector<uint8_t> chunk;
+  {
+    ThreadBuffer_ts::wat buffer_w(thread_state().m_buffer);
+    add_event(buffer_w, session, release_record, now);
+    append_number(buffer_w->m_buffer, ticket.m_request_id);
+    append_number(buffer_w->m_buffer, nanoseconds_between(ticket.m_acquired, now));
+    if (buffer_w->m_buffer.size() >= thread_flush_size)
+      chunk.swap(buffer_w->m_buffer);
+  }
+  if (!chunk.empty())
+    hand_over(chunk, session);
+}
+
+LockTraceReader::LockTraceReader(std::filesystem::path const& filename) : m_file(std::fopen(filename.c_str(), "rb")), m_time(0)
+{
+  if (!m_file)
+    THROW_ALERTE("Failed to open lock trace [FILENAME].", AIArgs("[FILENAME]", filename));
+  char magic[sizeof(LockTrace::magic)];
+  if (std::fread(magic, sizeof(magic), 1, m_file) != 1 || std::memcmp(magic, LockTrace::magic, sizeof(magic)) != 0)
+  {
+    std::fclose(m_file);
+    THROW_ALERT("[FILENAME] is not a lock trace.", AIArgs("[FILENAME]", filename));
+  }
+}
+
+LockTraceReader::~LockTraceReader()
+{
+  std::fclose(m_file);
+}
+
+bool LockTraceReader::read_number(uint64_t& number)
+{
+  number = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    int c = std::getc(m_file);
+    if (c == EOF)
+      return false;
+    number |= static_cast<uint64_t>(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      return true;
+  }
+  return false;         // Corrupt.
+}
+
+bool LockTraceReader::read_string(std::string& str)
+{
+  uint64_t length;
+  if (!read_number(length) || length > 4096)    // Paths are never this long.
+    return false;
+  str.resize(length);
+  return std::fread(str.data(), 1, length, m_file) == length;
+}
+
+bool LockTraceReader::next(Event& event)
+{
+  for (;;)
+  {
+    int type = std::getc(m_file);
+    uint64_t id, delta_time, number;
+    std::string name;
+    switch (type)
+    {
+      case LockTrace::lock_name_record:
+      case LockTrace::task_type_name_record:
+        if (!read_number(id) || !read_string(name))
+          return false;
+        (type == LockTrace::lock_name_record ? m_lock_names : m_task_type_names)[id] = std::move(name);
+        continue;
+      case LockTrace::request_record:
+      case LockTrace::acquire_record:
+      case LockTrace::release_record:
+        if (!read_number(delta_time) || !read_number(number))
+          return false;
+        m_time += delta_time;
+        event.m_type = static_cast<LockTrace::record_type>(type);
+        event.m_time = m_time;
+        event.m_request_id = number;
+        if (type == LockTrace::request_record)
+        {
+          if (!read_number(number))
+            return false;
+          event.m_lock_id = number;
+          if (!read_number(number))
+            return false;
+          event.m_task_type = number;
+        }
+        else if (type == LockTrace::release_record && !read_number(event.m_hold_duration))
+          return false;
+        return true;
+      case LockTrace::chunk_record:
+        // The events that follow are of a single thread, starting at this time.
+        if (!read_number(m_time))
+          return false;
+        continue;
+      case EOF:
+        return false;
+      default:
+        Dout(dc::warning, "Corrupt lock trace: unknown record type " << type << ".");
+        return false;
+    }
+  }
+}
@@ -0,0 +1,198 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class LockTrace.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "threadsafe/threadsafe.h"
+#include "debug.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// class LockTrace
+//
+// Records the lock traffic of TaskLock to a compact binary file, so that contention seen in
+// production can be analysed afterwards and replayed (see LockTraceReplay).
+//
+// Recording is off by default and costs a single relaxed atomic load per event then.
+// While recording, every TaskLock records three events:
+//
+//   request  - the TaskLock started (lock id, task type);
+//   acquire  - the lock was granted;
+//   release  - the lock was released (including the hold duration).
+//
+// The lock id refers to the canonical path of the lock file and the task type to the string
+// passed to TaskLock::set_task_type; both are written once, the first time they are used.
+//
+// Every thread encodes its events into a buffer of its own, that is only handed over to the
+// shared buffer (under a mutex) once it is full, and at stop(). The shared buffer is written
+// to the file without holding that mutex. Hence the file consists of chunks, each containing
+// the events of a single thread; events of different threads are not in time order.
+//
+// File format: the eight byte magic "FLTRACE2" followed by records. Each record starts with a
+// record type byte followed by unsigned LEB128 encoded integers:
+//
+//   lock_name:      lock_id, length, <length bytes: canonical path>
+//   task_type_name: task_type, length, <length bytes>
+//   request:        delta_time, request_id, lock_id, task_type
+//   acquire:        delta_time, request_id
+//   release:        delta_time, request_id, hold_duration
+//   chunk:          start_time
+//
+// where start_time is the number of nanoseconds since the start of the recording, delta_time
+// the number of nanoseconds since the previous event of the same chunk (or its start_time),
+// and hold_duration is in nanoseconds.
+//
+class LockTrace
+{
+ public:
+  using clock_type = std::chrono::steady_clock;
+  static constexpr char magic[8] = { 'F', 'L', 'T', 'R', 'A', 'C', 'E', '2' };
+
+  enum record_type : uint8_t {
+    lock_name_record,
+    task_type_name_record,
+    request_record,
+    acquire_record,
+    release_record,
+    chunk_record
+  };
+
+  // The recording state of a single TaskLock.
+  struct Ticket
+  {
+    uint32_t m_session = 0;                     // The recording session in which the request was recorded, or 0 if it wasn't.
+    uint32_t m_request_id;                      // Unique per session.
+    clock_type::time_point m_acquired;          // The time at which the lock was granted.
+  };
+
+ private:
+  // The events of one thread that weren't handed over to s_data yet.
+  struct ThreadBuffer
+  {
+    uint32_t m_session = 0;                                     // The recording session of the events in m_buffer.
+    std::vector<uint8_t> m_buffer;                              // Encoded records, starting with a chunk record (if not empty).
+    clock_type::time_point m_last_event;                        // The time of the last event in m_buffer.
+  };
+  using ThreadBuffer_ts = threadsafe::Unlocked<ThreadBuffer, threadsafe::policy::Primitive<std::mutex>>;
+
+  // The recording state of one thread.
+  struct ThreadState
+  {
+    ThreadBuffer_ts m_buffer;                                   // Only locked by another thread during stop() and start().
+    uint32_t m_session = 0;                                     // The recording session of the ids below.
+    std::map<std::string, uint32_t> m_lock_ids;                 // The lock ids that this thread already looked up.
+    std::map<std::string, uint32_t> m_task_types;               // The task type ids that this thread already looked up.
+
+    ThreadState();
+    ~ThreadState();
+  };
+
+  struct Data
+  {
+    std::FILE* m_file = nullptr;                                // The trace file, while recording.
+    std::vector<uint8_t> m_buffer;                              // Chunks that were handed over by the threads, but not written to m_file yet.
+    std::map<std::string, uint32_t> m_lock_ids;                 // Lock ids by canonical path.
+    std::map<std::string, uint32_t> m_task_types;               // Task type ids by name.
+    std::vector<ThreadState*> m_threads;                        // The threads that recorded events.
+    uint32_t m_session = 0;                                     // Incremented every time a recording is started.
+  };
+  using Data_ts = threadsafe::Unlocked<Data, threadsafe::policy::Primitive<std::mutex>>;
+
+  static Data_ts s_data;
+  static std::mutex s_file_mutex;                               // Locked while writing to the trace file; after locking s_data.
+  static std::atomic<uint32_t> s_recording_session;             // The session being recorded, or 0 when not recording.
+  static std::atomic<clock_type::rep> s_start;                  // The start of the recording (time_since_epoch).
+  static std::atomic<uint32_t> s_last_request_id;
+
+ public:
+  // Start recording to filename (truncating it). Throws AIAlert::Error if the file can't be created.
+  static void start(std::filesystem::path const& filename);
+  // Stop recording and close the trace file. Does nothing if not recording.
+  static void stop();
+
+  static bool recording() { return s_recording_session.load(std::memory_order_relaxed) != 0; }
+
+  // Called by TaskLock.
+  static void request(Ticket& ticket, std::filesystem::path const& canonical_path, char const* task_type);
+  static void acquire(Ticket& ticket);
+  static void release(Ticket& ticket);
+
+ private:
+  static ThreadState& thread_state();
+  static bool get_id(ThreadState& thread_state, uint32_t session, std::string const& name, bool is_lock, uint32_t& id, bool& is_new);
+  static void add_event(ThreadBuffer_ts::wat const& buffer_w, uint32_t session, record_type type, clock_type::time_point now);
+  static void hand_over(std::vector<uint8_t>& chunk, uint32_t session);
+  static void write(std::FILE* file, std::vector<uint8_t> const& buffer);
+};
+
+// class LockTraceReader
+//
+// Reads a file written by LockTrace.
+//
+class LockTraceReader
+{
+ public:
+  struct Event
+  {
+    LockTrace::record_type m_type;              // One of request_record, acquire_record or release_record.
+    uint64_t m_time;                            // Nanoseconds since the start of the recording.
+    uint32_t m_request_id;
+    uint32_t m_lock_id;                         // Only valid for request_record.
+    uint32_t m_task_type;                       // Only valid for request_record.
+    uint64_t m_hold_duration;                   // Only valid for release_record (nanoseconds).
+  };
+
+ private:
+  std::FILE* m_file;
+  uint64_t m_time;                                              // The time of the last event (or chunk) read.
+  std::map<uint32_t, std::string> m_lock_names;                 // Canonical paths by lock id.
+  std::map<uint32_t, std::string> m_task_type_names;            // Task type names by id.
+
+ public:
+  // Open the trace filename. Throws AIAlert::Error if it can't be opened or isn't a lock trace.
+  LockTraceReader(std::filesystem::path const& filename);
+  ~LockTraceReader();
+
+  // Read the next event. Returns false at the end of the file (or of the valid part of a truncated file).
+  // Events of different threads are not in time order (see LockTrace): sort them by m_time if needed.
+  bool next(Event& event);
+
+  // The names seen so far.
+  std::map<uint32_t, std::string> const& lock_names() const { return m_lock_names; }
+  std::map<uint32_t, std::string> const& task_type_names() const { return m_task_type_names; }
+
+ private:
+  bool read_number(uint64_t& number);
+  bool read_string(std::string& str);
+};
@@ -0,0 +1,228 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class LockTraceReplay.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "LockTraceReplay.h"
+#include <algorithm>
+#include <unordered_map>
+
+namespace task {
+
+char const* LockTraceReplayTask::state_str_impl(state_type run_state) const
+{
+  switch (run_state)
+  {
+    AI_CASE_RETURN(LockTraceReplayTask_lock);
+    AI_CASE_RETURN(LockTraceReplayTask_locked);
+    AI_CASE_RETURN(LockTraceReplayTask_release);
+  }
+  ASSERT(false);
+  return "UNKNOWN STATE";
+}
+
+void LockTraceReplayTask::multiplex_impl(state_type run_state)
+{
+  switch (run_state)
+  {
+    case LockTraceReplayTask_lock:
+      m_start = LockTrace::clock_type::now();
+      m_task_lock = statefultask::create<TaskLock>(FileLockAccess(m_file_lock));
+      m_task_lock->set_task_type(m_replay->m_requests[m_request].m_task_type);
+      set_state(LockTraceReplayTask_locked);
+      m_task_lock->run(this, 1);
+      wait(1);
+      break;
+    case LockTraceReplayTask_locked:
+      // Wait until LockTraceReplay::run signals us that the hold duration passed.
+      set_state(LockTraceReplayTask_release);
+      wait(2);
+      m_replay->locked(this, m_request, LockTrace::clock_type::now() - m_start);
+      break;
+    case LockTraceReplayTask_release:
+      m_task_lock->unlock();
+      // Release the FileLockAccess before LockTraceReplay::run destroys the FileLock.
+      m_task_lock.reset();
+      finish();
+      break;
+  }
+}
+
+} // namespace task
+
+LockTraceReplay::LockTraceReplay(std::filesystem::path const& trace_filename) : m_speed(1.0), m_running(0)
+{
+  DoutEntering(dc::notice, "LockTraceReplay(" << trace_filename << ")");
+  LockTraceReader reader(trace_filename);
+  struct Recorded
+  {
+    Request m_request;
+    uint32_t m_task_type;
+    bool m_complete;
+  };
+  std::vector<Recorded> recorded;
+  // The requests that are still waiting for, or holding, their lock: index into recorded by request id.
+  std::unordered_map<uint32_t, size_t> pending;
+  // The events of different threads are not in time order: sort them first.
+  std::vector<LockTraceReader::Event> events;
+  LockTraceReader::Event event;
+  while (reader.next(event))
+    events.push_back(event);
+  std::stable_sort(events.begin(), events.end(), [](LockTraceReader::Event const& e1, LockTraceReader::Event const& e2){
+      // A request, acquire and release that were recorded at the same time still happened in that order.
+      return e1.m_time < e2.m_time || (e1.m_time == e2.m_time && e1.m_type < e2.m_type); });
+  for (LockTraceReader::Event const& event : events)
+  {
+    switch (event.m_type)
+    {
+      case LockTrace::request_record:
+        pending[event.m_request_id] = recorded.size();
+        recorded.push_back({{std::chrono::nanoseconds(event.m_time), event.m_lock_id, nullptr,
+            std::chrono::nanoseconds::zero(), std::chrono::nanoseconds::zero()}, event.m_task_type, false});
+        break;
+      case LockTrace::acquire_record:
+      {
+        auto iter = pending.find(event.m_request_id);
+        if (iter != pending.end())
+        {
+          Request& request = recorded[iter->second].m_request;
+          request.m_recorded_wait = std::chrono::nanoseconds(event.m_time) - request.m_time;
+        }
+        break;
+      }
+      case LockTrace::release_record:
+      {
+        auto iter = pending.find(event.m_request_id);
+        if (iter != pending.end())
+        {
+          recorded[iter->second].m_request.m_hold_duration = std::chrono::nanoseconds(event.m_hold_duration);
+          recorded[iter->second].m_complete = true;
+          pending.erase(iter);
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  m_lock_names = reader.lock_names();
+  m_task_type_names = reader.task_type_names();
+  for (Recorded& entry : recorded)
+  {
+    if (!entry.m_complete)
+      continue;
+    auto task_type = m_task_type_names.find(entry.m_task_type);
+    entry.m_request.m_task_type = task_type == m_task_type_names.end() ? "unknown" : task_type->second.c_str();
+    m_requests.push_back(entry.m_request);
+  }
+  Dout(dc::notice, "Read " << m_requests.size() << " complete requests on " << m_lock_names.size() << " locks.");
+}
+
+void LockTraceReplay::locked(task::LockTraceReplayTask* replay_task, size_t request, std::chrono::nanoseconds replayed_wait)
+{
+  Request const& recorded = m_requests[request];
+  std::lock_guard<std::mutex> lock(m_mutex);
+  LockStatistics& statistics = m_statistics[recorded.m_lock_id];
+  ++statistics.m_acquisitions;
+  statistics.m_recorded_wait += recorded.m_recorded_wait;
+  statistics.m_replayed_wait += replayed_wait;
+  statistics.m_max_recorded_wait = std::max(statistics.m_max_recorded_wait, recorded.m_recorded_wait);
+  statistics.m_max_replayed_wait = std::max(statistics.m_max_replayed_wait, replayed_wait);
+  m_releases.emplace(clock_type::now() + scaled(recorded.m_hold_duration), replay_task);
+  m_condition.notify_one();
+}
+
+std::vector<LockTraceReplay::LockStatistics> LockTraceReplay::run(std::filesystem::path const& lock_directory, double speed)
+{
+  DoutEntering(dc::notice, "LockTraceReplay::run(" << lock_directory << ", " << speed << ")");
+  // The speed must be positive.
+  ASSERT(speed > 0.0);
+  m_speed = speed;
+
+  // One lock file per recorded lock.
+  std::map<uint32_t, std::unique_ptr<FileLock>> file_locks;
+  for (auto const& lock_name : m_lock_names)
+    file_locks[lock_name.first] = std::make_unique<FileLock>(lock_directory / ("lock" + std::to_string(lock_name.first)));
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_statistics.clear();
+  m_running = 0;
+  clock_type::time_point const start = clock_type::now();
+  size_t next_request = 0;
+  while (next_request < m_requests.size() || m_running > 0)
+  {
+    clock_type::time_point deadline = clock_type::time_point::max();
+    if (next_request < m_requests.size())
+      deadline = start + scaled(m_requests[next_request].m_time);
+    if (!m_releases.empty() && m_releases.begin()->first < deadline)
+      deadline = m_releases.begin()->first;
+    if (deadline == clock_type::time_point::max())
+    {
+      m_condition.wait(lock);
+      continue;
+    }
+    if (clock_type::now() < deadline)
+    {
+      m_condition.wait_until(lock, deadline);
+      continue;
+    }
+    if (!m_releases.empty() && m_releases.begin()->first == deadline)
+    {
+      // The hold duration of this task passed.
+      task::LockTraceReplayTask* replay_task = m_releases.begin()->second;
+      m_releases.erase(m_releases.begin());
+      lock.unlock();
+      replay_task->signal(2);
+    }
+    else
+    {
+      // Start the next request.
+      ++m_running;
+      size_t const request = next_request++;
+      lock.unlock();
+      auto replay_task = statefultask::create<task::LockTraceReplayTask>(this, *file_locks[m_requests[request].m_lock_id], request);
+      replay_task->run([this](bool CWDEBUG_ONLY(success)){
+        // LockTraceReplayTask never aborts.
+        ASSERT(success);
+        std::lock_guard<std::mutex> lock(m_mutex);
+        --m_running;
+        m_condition.notify_one();
+      });
+    }
+    lock.lock();
+  }
+  lock.unlock();
+
+  std::vector<LockStatistics> result;
+  for (auto& statistics : m_statistics)
+  {
+    statistics.second.m_recorded_path = m_lock_names[statistics.first];
+    Dout(dc::notice, statistics.second.m_recorded_path << ": " << statistics.second.m_acquisitions << " acquisitions, waited " <<
+        statistics.second.m_replayed_wait.count() << " ns (recorded: " << statistics.second.m_recorded_wait.count() << " ns).");
+    result.push_back(std::move(statistics.second));
+  }
+  return result;
+}
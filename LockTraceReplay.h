@@ -0,0 +1,151 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class LockTraceReplay.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "TaskLock.h"
+#include "LockTrace.h"
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class LockTraceReplay;
+
+namespace task {
+
+// A synthetic task that replays one recorded request: it obtains the lock with a TaskLock,
+// holds it for the recorded hold duration and then releases it.
+class LockTraceReplayTask : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum lock_trace_replay_task_state_type {
+    LockTraceReplayTask_lock = direct_base_type::state_end,     // The first state.
+    LockTraceReplayTask_locked,
+    LockTraceReplayTask_release
+  };
+
+ private:
+  LockTraceReplay* m_replay;
+  FileLock& m_file_lock;
+  size_t const m_request;                                       // The index of the replayed request (see LockTraceReplay::m_requests).
+  boost::intrusive_ptr<TaskLock> m_task_lock;
+  LockTrace::clock_type::time_point m_start;                    // The time at which the lock was requested.
+
+ public:
+  LockTraceReplayTask(LockTraceReplay* replay, FileLock& file_lock, size_t request) :
+    AIStatefulTask(CWDEBUG_ONLY(false)), m_replay(replay), m_file_lock(file_lock), m_request(request) { }
+
+  static state_type constexpr state_end = LockTraceReplayTask_release + 1;
+
+ private:
+  char const* task_name_impl() const override { return "LockTraceReplayTask"; }
+  char const* state_str_impl(state_type run_state) const final override;
+  void multiplex_impl(state_type run_state) final override;
+};
+
+} // namespace task
+
+// class LockTraceReplay
+//
+// Drives the lock traffic of a trace recorded with LockTrace through FileLock and TaskLock, with
+// one synthetic task (LockTraceReplayTask) per recorded request: each starts at the recorded time
+// (relative to the start of the recording), holds its lock for the recorded hold duration and
+// measures how long it had to wait. Comparing the replayed waiting times with the recorded ones,
+// or with those of another replay, shows the effect of a change in scheduling policy on a real workload.
+//
+// Every recorded lock is replaced by a lock file in the directory passed to run(); use a
+// FakeFileLockBackend to keep the replay off the disk (see LockDomain::set_backend).
+// The synthetic tasks pass the recorded task type to their TaskLock, so a replay can itself be
+// recorded again.
+//
+// Usage:
+//
+//   LockTraceReplay replay("production.trace");
+//   for (auto const& statistics : replay.run("/tmp/replay"))
+//     std::cout << statistics.m_recorded_path << ": " << statistics.m_replayed_wait.count() << '\n';
+//
+// Requests that were not released before the recording stopped are not replayed.
+//
+class LockTraceReplay
+{
+ public:
+  struct LockStatistics
+  {
+    std::string m_recorded_path;                                // The canonical path of the lock in the trace.
+    size_t m_acquisitions = 0;                                  // The number of replayed requests.
+    std::chrono::nanoseconds m_recorded_wait{0};                // The total recorded waiting time.
+    std::chrono::nanoseconds m_replayed_wait{0};                // The total waiting time during the replay.
+    std::chrono::nanoseconds m_max_recorded_wait{0};            // The longest recorded waiting time.
+    std::chrono::nanoseconds m_max_replayed_wait{0};            // The longest waiting time during the replay.
+  };
+
+ private:
+  friend class task::LockTraceReplayTask;
+  using clock_type = LockTrace::clock_type;
+
+  struct Request
+  {
+    std::chrono::nanoseconds m_time;                            // The time of the request, relative to the start of the recording.
+    uint32_t m_lock_id;
+    char const* m_task_type;                                    // Points into m_task_type_names.
+    std::chrono::nanoseconds m_recorded_wait;
+    std::chrono::nanoseconds m_hold_duration;
+  };
+
+  std::vector<Request> m_requests;                              // All complete requests, in the order of the recording.
+  std::map<uint32_t, std::string> m_lock_names;                 // The recorded canonical paths by lock id.
+  std::map<uint32_t, std::string> m_task_type_names;            // The recorded task types by id.
+  double m_speed;                                               // The speed of the current replay.
+
+  std::mutex m_mutex;                                           // Protects the members below.
+  std::condition_variable m_condition;                          // Notified when m_releases or m_running changes.
+  std::multimap<clock_type::time_point, task::LockTraceReplayTask*> m_releases;    // Tasks that hold their lock, by the time they should release it.
+  size_t m_running;                                             // The number of synthetic tasks that did not finish yet.
+  std::map<uint32_t, LockStatistics> m_statistics;              // Statistics by lock id.
+
+ public:
+  // Read trace_filename. Throws AIAlert::Error if it can't be read.
+  LockTraceReplay(std::filesystem::path const& trace_filename);
+
+  // Replay the trace, using lock files in lock_directory. A speed larger than 1 compresses time
+  // (both the arrival times and the hold durations). Blocks until the replay is finished.
+  std::vector<LockStatistics> run(std::filesystem::path const& lock_directory, double speed = 1.0);
+
+ private:
+  std::chrono::nanoseconds scaled(std::chrono::nanoseconds duration) const
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration / m_speed);
+  }
+
+  // Called by LockTraceReplayTask.
+  void locked(task::LockTraceReplayTask* replay_task, size_t request, std::chrono::nanoseconds replayed_wait);
+};
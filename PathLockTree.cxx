@@ -0,0 +1,312 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class PathLockTree.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "PathLockTree.h"
+#include <algorithm>
+
+namespace {
+
+constexpr bool compatibility_table[4][4] = {
+  //            IS     IX     S      X
+  /* IS */   {  true,  true,  true,  false },
+  /* IX */   {  true,  true,  false, false },
+  /* S  */   {  true,  false, true,  false },
+  /* X  */   {  false, false, false, false }
+};
+
+bool compatible(PathLockMode mode1, PathLockMode mode2)
+{
+  return compatibility_table[static_cast<int>(mode1)][static_cast<int>(mode2)];
+}
+
+// The mode that is taken on the ancestors of a node that is locked with mode.
+PathLockMode intent(PathLockMode mode)
+{
+  return (mode == PathLockMode::S || mode == PathLockMode::IS) ? PathLockMode::IS : PathLockMode::IX;
+}
+
+} // namespace
+
+char const* to_string(PathLockMode mode)
+{
+  switch (mode)
+  {
+    AI_CASE_RETURN(PathLockMode::IS);
+    AI_CASE_RETURN(PathLockMode::IX);
+    AI_CASE_RETURN(PathLockMode::S);
+    AI_CASE_RETURN(PathLockMode::X);
+  }
+  ASSERT(false);
+  return "UNKNOWN PathLockMode";
+}
+
+//static
+PathLockTree PathLockTree::s_instance;
+
+//static
+PathLockTree::Node* PathLockTree::get_node(Data& data, std::filesystem::path const& path)
+{
+  // Only pass paths as returned by FileLock::canonical_path(), or std::filesystem::absolute(path).lexically_normal().
+  ASSERT(path.is_absolute());
+  Node* node = &data.m_root;
+  for (auto const& component : path.relative_path())
+  {
+    // Lexically normal directories can end on a '/', resulting in an empty last component.
+    if (component.empty())
+      continue;
+    auto& child = node->m_children[component.native()];
+    if (!child)
+      child.reset(new Node(node, component.native()));
+    node = child.get();
+  }
+  // Count the new reference in the node and all of its ancestors, so that none of them is removed while in use.
+  for (Node* n = node; n; n = n->m_parent)
+    ++n->m_references;
+  return node;
+}
+
+//static
+PathLockTree::Node* PathLockTree::find_node(Data& data, std::filesystem::path const& path)
+{
+  Node* node = &data.m_root;
+  for (auto const& component : path.relative_path())
+  {
+    if (component.empty())
+      continue;
+    auto child = node->m_children.find(component.native());
+    // The node of a granted lock always exists.
+    ASSERT(child != node->m_children.end());
+    node = child->second.get();
+  }
+  return node;
+}
+
+//static
+void PathLockTree::release_node(Node* node)
+{
+  while (node->m_parent)
+  {
+    Node* parent = node->m_parent;
+    if (--node->m_references == 0)
+    {
+      // No granted or queued request refers to this node or any of its descendants anymore.
+      ASSERT(node->m_children.empty());
+      auto iter = parent->m_children.find(node->m_component);
+      ASSERT(iter != parent->m_children.end() && iter->second.get() == node);
+      parent->m_children.erase(iter);
+    }
+    node = parent;
+  }
+  --node->m_references;         // The root.
+}
+
+//static
+bool PathLockTree::is_grantable(Node const* node, PathLockMode mode)
+{
+  PathLockMode requested = mode;
+  for (Node const* n = node; n; n = n->m_parent)
+  {
+    for (int granted = 0; granted < 4; ++granted)
+      if (n->m_granted[granted] > 0 && !compatible(requested, static_cast<PathLockMode>(granted)))
+        return false;
+    requested = intent(mode);
+  }
+  return true;
+}
+
+//static
+bool PathLockTree::conflicts(Node const* node1, PathLockMode mode1, Node const* node2, PathLockMode mode2)
+{
+  // Walk up from node2 and, for every node on the way that is also node1 or an ancestor of it,
+  // check whether the modes that both requests need on that node are compatible.
+  PathLockMode requested2 = mode2;
+  for (Node const* n2 = node2; n2; n2 = n2->m_parent)
+  {
+    PathLockMode requested1 = mode1;
+    for (Node const* n1 = node1; n1; n1 = n1->m_parent)
+    {
+      if (n1 == n2)
+      {
+        if (!compatible(requested1, requested2))
+          return true;
+        break;
+      }
+      requested1 = intent(mode1);
+    }
+    requested2 = intent(mode2);
+  }
+  return false;
+}
+
+//static
+void PathLockTree::grant(Node* node, PathLockMode mode, int count)
+{
+  node->m_granted[static_cast<int>(mode)] += count;
+  PathLockMode const intent_mode = intent(mode);
+  for (Node* n = node->m_parent; n; n = n->m_parent)
+    n->m_granted[static_cast<int>(intent_mode)] += count;
+}
+
+//static
+bool PathLockTree::overtakes(Data const& data, Request const& request)
+{
+  // Return true if request conflicts with an earlier request that is still waiting (or draining).
+  for (Request const& earlier : data.m_waiting)
+  {
+    if (earlier.m_sequence >= request.m_sequence)
+      break;            // m_waiting is sorted by m_sequence.
+    if (conflicts(earlier.m_node, earlier.m_mode, request.m_node, request.m_mode))
+      return true;
+  }
+  for (Request const& earlier : data.m_draining)
+    if (earlier.m_sequence < request.m_sequence && conflicts(earlier.m_node, earlier.m_mode, request.m_node, request.m_mode))
+      return true;
+  return false;
+}
+
+//static
+void PathLockTree::grant_waiting(Data& data, std::vector<Request>& granted_requests)
+{
+  // Grant waiting requests in FIFO order, skipping those that conflict with an earlier request that is still waiting.
+  for (auto request = data.m_waiting.begin(); request != data.m_waiting.end();)
+  {
+    if (!is_grantable(request->m_node, request->m_mode) || overtakes(data, *request))
+    {
+      ++request;
+      continue;
+    }
+    grant(request->m_node, request->m_mode, 1);
+    granted_requests.push_back(*request);
+    request = data.m_waiting.erase(request);
+  }
+}
+
+bool PathLockTree::lock(Data_ts::wat const& data_w, AIStatefulTask* task, AIStatefulTask::condition_type condition, std::filesystem::path const& path, PathLockMode mode)
+{
+  DoutEntering(dc::notice, "PathLockTree::lock(" << task << ", " << condition << ", " << path << ", " << mode << ")");
+  Request const request{task, condition, get_node(*data_w, path), mode, ++data_w->m_last_sequence};
+  // Don't overtake earlier requests that we conflict with.
+  if (is_grantable(request.m_node, mode) && !overtakes(*data_w, request))
+  {
+    grant(request.m_node, mode, 1);
+    return true;
+  }
+  data_w->m_waiting.push_back(request);
+  return false;
+}
+
+bool PathLockTree::lock_file(AIStatefulTask* task, AIStatefulTask::condition_type condition, std::filesystem::path const& path, bool& tracked)
+{
+  // Announce ourselves before checking for SubtreeLock requests; lock_subtree does the reverse.
+  // Hence either we see the SubtreeLock request, or it sees us (and waits until we're gone).
+  m_untracked.fetch_add(1);
+  if (m_subtree_locks.load() == 0)
+  {
+    tracked = false;
+    return true;
+  }
+  release_untracked();
+  tracked = true;
+  return lock(Data_ts::wat(m_data), task, condition, path, PathLockMode::IX);
+}
+
+void PathLockTree::unlock_file(std::filesystem::path const& path, bool tracked)
+{
+  if (tracked)
+    unlock(path, PathLockMode::IX);
+  else
+    release_untracked();
+}
+
+void PathLockTree::release_untracked()
+{
+  if (m_untracked.fetch_sub(1) != 1 || m_subtree_locks.load() == 0)
+    return;
+  // The last file lock that skipped the tree is gone; queue the SubtreeLock requests that were waiting for that.
+  std::vector<Request> granted_requests;
+  {
+    Data_ts::wat data_w(m_data);
+    // If it was incremented again in the meantime, then the task that did that will do this when decrementing it.
+    if (m_untracked.load() > 0)
+      return;
+    // Insert them in m_waiting in the order in which they were made; then see what can be granted.
+    for (Request const& request : data_w->m_draining)
+    {
+      auto position = std::upper_bound(data_w->m_waiting.begin(), data_w->m_waiting.end(), request.m_sequence,
+          [](uint64_t sequence, Request const& waiting){ return sequence < waiting.m_sequence; });
+      data_w->m_waiting.insert(position, request);
+    }
+    data_w->m_draining.clear();
+    grant_waiting(*data_w, granted_requests);
+  }
+  for (Request const& request : granted_requests)
+    request.m_task->signal(request.m_condition);
+}
+
+bool PathLockTree::lock_subtree(AIStatefulTask* task, AIStatefulTask::condition_type condition, std::filesystem::path const& path, PathLockMode mode)
+{
+  // Subtrees are locked with S or X.
+  ASSERT(mode == PathLockMode::S || mode == PathLockMode::X);
+  // From now on lock_file no longer skips the tree.
+  m_subtree_locks.fetch_add(1);
+  Data_ts::wat data_w(m_data);
+  if (m_untracked.load() > 0 || !data_w->m_draining.empty())
+  {
+    // Wait until the file locks that skipped the tree are released; release_untracked will queue us.
+    data_w->m_draining.push_back({task, condition, get_node(*data_w, path), mode, ++data_w->m_last_sequence});
+    return false;
+  }
+  return lock(data_w, task, condition, path, mode);
+}
+
+void PathLockTree::unlock_subtree(std::filesystem::path const& path, PathLockMode mode)
+{
+  unlock(path, mode);
+  m_subtree_locks.fetch_sub(1);
+}
+
+void PathLockTree::unlock(std::filesystem::path const& path, PathLockMode mode)
+{
+  DoutEntering(dc::notice, "PathLockTree::unlock(" << path << ", " << mode << ")");
+  std::vector<Request> granted_requests;
+  {
+    Data_ts::wat data_w(m_data);
+    Node* node = find_node(*data_w, path);
+    // Unlocking something that isn't locked?
+    ASSERT(node->m_granted[static_cast<int>(mode)] > 0);
+    grant(node, mode, -1);
+    // The reference of lock().
+    release_node(node);
+
+    grant_waiting(*data_w, granted_requests);
+  } // Unlock m_data before waking up the tasks.
+
+  for (Request const& request : granted_requests)
+    request.m_task->signal(request.m_condition);
+}
@@ -0,0 +1,168 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class PathLockTree.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "statefultask/AIStatefulTask.h"
+#include "statefultask/AIStatefulTaskMutex.h"
+#include "debug.h"
+#include <filesystem>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// The modes of a hierarchical (path) lock.
+//
+// IS and IX are 'intent' locks: they are taken on every ancestor directory of a path that is
+// locked with S (shared) or X (exclusive) respectively, so that a lock on a directory conflicts
+// with locks on anything inside that directory.
+//
+// Compatibility:
+//
+//       IS  IX  S   X
+//   IS  y   y   y   n
+//   IX  y   y   n   n
+//   S   y   n   y   n
+//   X   n   n   n   n
+//
+enum class PathLockMode
+{
+  IS,
+  IX,
+  S,
+  X
+};
+
+char const* to_string(PathLockMode mode);
+inline std::ostream& operator<<(std::ostream& os, PathLockMode mode) { return os << to_string(mode); }
+
+// class PathLockTree
+//
+// A trie of path components, built from the canonical paths of the FileLock registry (and the
+// directories that are locked as a whole), that keeps track of the hierarchical locks held by tasks.
+//
+// Locking a node with mode S or X locks the whole subtree below it: the intent locks that are
+// taken on the ancestors of every other locked path make the two conflict where they should.
+// task::TaskLock takes an IX lock on the canonical path of its FileLock before locking the
+// FileLock itself (which provides the mutual exclusion between TaskLock objects of the same file),
+// and task::SubtreeLock can be used to lock a whole directory in one go.
+//
+// Note that paths are compared lexically: a directory has to be locked using the same prefix
+// as the canonical paths of the FileLock objects inside it.
+//
+// Like AIStatefulTaskMutex, a request that can't be granted immediately is queued and the task
+// is signalled with the passed condition once it was granted. Requests are granted in FIFO order
+// for as far as they conflict with each other; unrelated paths don't wait for each other.
+//
+// As long as no SubtreeLock is used, nothing can conflict with the IX lock of a TaskLock; then
+// lock_file skips the tree altogether (it only increments an atomic counter), so that TaskLock
+// doesn't pay for the (global) mutex and the node allocations of the trie. The first SubtreeLock
+// request waits until all TaskLock objects that skipped the tree released their lock; from then
+// on, until the last SubtreeLock is released, TaskLock objects go through the tree.
+//
+class PathLockTree
+{
+ private:
+  struct Node
+  {
+    Node* const m_parent;                                       // The parent directory, or nullptr for the root.
+    std::string const m_component;                              // The key of this node in m_parent->m_children.
+    std::map<std::string, std::unique_ptr<Node>> m_children;    // The child nodes by path component.
+    std::array<int, 4> m_granted;                               // The number of granted locks on this node, per PathLockMode.
+    int m_references;                                           // The number of granted and queued requests that refer to this node or a descendant.
+
+    Node(Node* parent, std::string const& component) : m_parent(parent), m_component(component), m_granted{}, m_references(0) { }
+  };
+
+  struct Request
+  {
+    AIStatefulTask* m_task;                                     // The task that is waiting.
+    AIStatefulTask::condition_type m_condition;                 // The condition to signal m_task with once the request was granted.
+    Node* m_node;                                               // The node to lock.
+    PathLockMode m_mode;                                        // The mode to lock m_node with.
+    uint64_t m_sequence;                                        // The order in which the requests were made.
+  };
+
+  struct Data
+  {
+    Node m_root;                                                // The root directory.
+    std::deque<Request> m_waiting;                              // Requests that could not be granted yet, in FIFO order.
+    std::vector<Request> m_draining;                            // SubtreeLock requests that wait until m_untracked is zero, in FIFO order.
+    uint64_t m_last_sequence = 0;                               // The m_sequence of the last request.
+
+    Data() : m_root(nullptr, {}) { }
+  };
+  using Data_ts = threadsafe::Unlocked<Data, threadsafe::policy::Primitive<std::mutex>>;
+
+  Data_ts m_data;
+  std::atomic<int> m_subtree_locks;                             // The number of SubtreeLock requests, queued or granted.
+  std::atomic<int> m_untracked;                                 // The number of file locks that skipped the tree (see lock_file).
+
+  static PathLockTree s_instance;
+
+ public:
+  PathLockTree() : m_subtree_locks(0), m_untracked(0) { }
+
+  // The PathLockTree that is used by FileLock (read: by TaskLock and SubtreeLock).
+  static PathLockTree& instance() { return s_instance; }
+
+  // Take an IX lock on path, the canonical path of a file lock, on behalf of task (used by TaskLock).
+  // Returns true if the lock was granted immediately. Otherwise returns false and task will be
+  // signalled with condition once the lock was granted; the task should wait(condition) and
+  // then owns the lock. tracked must be passed to unlock_file.
+  bool lock_file(AIStatefulTask* task, AIStatefulTask::condition_type condition, std::filesystem::path const& path, bool& tracked);
+
+  // Release a lock obtained with lock_file.
+  void unlock_file(std::filesystem::path const& path, bool tracked);
+
+  // Lock the directory path with mode S or X on behalf of task (used by SubtreeLock).
+  // Returns true if the lock was granted immediately, otherwise task is signalled with condition
+  // once it was granted. Path must be absolute and lexically normal.
+  bool lock_subtree(AIStatefulTask* task, AIStatefulTask::condition_type condition, std::filesystem::path const& path, PathLockMode mode);
+
+  // Release a lock obtained with lock_subtree. The path and mode must be the same as passed to lock_subtree.
+  void unlock_subtree(std::filesystem::path const& path, PathLockMode mode);
+
+ private:
+  bool lock(Data_ts::wat const& data_w, AIStatefulTask* task, AIStatefulTask::condition_type condition, std::filesystem::path const& path, PathLockMode mode);
+  void unlock(std::filesystem::path const& path, PathLockMode mode);
+  void release_untracked();
+  static bool overtakes(Data const& data, Request const& request);
+  static void grant_waiting(Data& data, std::vector<Request>& granted_requests);
+
+  static Node* get_node(Data& data, std::filesystem::path const& path);
+  static Node* find_node(Data& data, std::filesystem::path const& path);
+  static void release_node(Node* node);
+  static bool is_grantable(Node const* node, PathLockMode mode);
+  static bool conflicts(Node const* node1, PathLockMode mode1, Node const* node2, PathLockMode mode2);
+  static void grant(Node* node, PathLockMode mode, int count);
+};
@@ -0,0 +1,269 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class PosixFileLockBackend.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "PosixFileLockBackend.h"
+#include "utils/AIAlert.h"
+#include "debug.h"
+#include <boost/interprocess/sync/file_lock.hpp>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+class PosixLockFile : public FileLockBackend::LockFile
+{
+ public:
+  using inode_id_type = FileLockBackend::inode_id_type;
+
+ private:
+  std::filesystem::path const m_path;
+  boost::interprocess::file_lock m_file_lock;   // The file lock. The boost documentation advises to use the same thread to
+                                                // lock and unlock a file-- but that is too restrictive imho.
+  std::FILE* m_stream;                          // This points to an open file m_path while the file lock is held. We can't
+                                                // close it until then, because that also unlocks the file lock!
+  bool m_locked;                                // True while we hold the file lock.
+  int const m_fd;                               // A read-only file descriptor of the opened file, used for test_lock. It is kept
+                                                // open because closing it while holding the file lock would release the lock.
+  inode_id_type const m_inode_id;               // The inode of m_fd.
+
+ public:
+  PosixLockFile(std::filesystem::path const& path, boost::interprocess::file_lock&& file_lock, int fd, inode_id_type inode_id) :
+    m_path(path), m_file_lock(std::move(file_lock)), m_stream(nullptr), m_locked(false), m_fd(fd), m_inode_id(inode_id) { }
+
+  ~PosixLockFile()
+  {
+    // The file lock must be released first.
+    ASSERT(!m_locked && !m_stream);
+    close(m_fd);
+  }
+
+  inode_id_type inode_id() const override
+  {
+    return m_inode_id;
+  }
+
+  bool try_lock() override
+  {
+    m_locked = m_file_lock.try_lock();
+    return m_locked;
+  }
+
+  void unlock() override
+  {
+    m_file_lock.unlock();
+    m_locked = false;
+    if (m_stream)
+    {
+      std::fclose(m_stream);
+      m_stream = nullptr;
+    }
+  }
+
+  bool test_lock(pid_t& holder) override
+  {
+    // FileLock::query_holder only calls this while we don't have the lock.
+    ASSERT(!m_locked);
+    // Ask the kernel who would conflict with an exclusive lock on the whole file (which is what boost's file_lock takes).
+    // Note that F_GETLK doesn't report locks of the calling process; FileLock::query_holder deals with those.
+    struct flock lock = {};
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0;
+    if (fcntl(m_fd, F_GETLK, &lock) == -1)
+    {
+      Dout(dc::warning, "fcntl(F_GETLK) on " << m_path << ": " << std::strerror(errno));
+      holder = 0;
+      return false;
+    }
+    if (lock.l_type == F_UNLCK)
+      return false;
+    holder = lock.l_pid;        // This is -1 for an open file description lock; treat that as unknown.
+    if (holder < 0)
+      holder = 0;
+    return true;
+  }
+
+  size_t read(void* buffer, size_t size) override
+  {
+    // (Try to) open file for reading from the start, and writing, in binary mode.
+    // Note that is extremely unlikely to fail when locking it succeeded.
+    if (!m_stream && !(m_stream = std::fopen(m_path.c_str(), "r+b")))
+    {
+      if (m_locked)
+        THROW_ALERTE("Failed to open lock file [FILENAME] after locking it?!", AIArgs("[FILENAME]", m_path));
+      return 0;
+    }
+    std::rewind(m_stream);
+    size_t len = std::fread(buffer, 1, size, m_stream);
+    // Closing the file is only allowed while we don't have the lock.
+    if (!m_locked)
+    {
+      std::fclose(m_stream);
+      m_stream = nullptr;
+    }
+    return len;
+  }
+
+  bool write(void const* buffer, size_t size) override
+  {
+    // Only write while holding the lock (which requires a call to read first).
+    ASSERT(m_locked && m_stream);
+    std::rewind(m_stream);
+    bool success = std::fwrite(buffer, size, 1, m_stream) == 1;
+    // We must flush the data asap.
+    return std::fflush(m_stream) == 0 && success;
+  }
+
+  void* map(size_t size) override
+  {
+    // Closing ANY file descriptor of the lock file releases the file lock (POSIX), so we may only
+    // open and close the file here while we do not hold the file lock.
+    ASSERT(!m_locked);
+
+    int fd = ::open(m_path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+      THROW_ALERTE("Failed to open lock file [FILENAME].", AIArgs("[FILENAME]", m_path));
+
+    // Extend the file if it is too small. Unlike ftruncate this never shrinks the file, so it is safe
+    // when another process concurrently extends it (even to a larger size) and already writes to it.
+    int error = posix_fallocate(fd, 0, size);
+    if (error)
+    {
+      close(fd);
+      THROW_ALERTC(error, "posix_fallocate([FILENAME], 0, [SIZE])", AIArgs("[FILENAME]", m_path)("[SIZE]", size));
+    }
+
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    // The mapping stays valid after closing the file descriptor.
+    close(fd);
+    if (mapping == MAP_FAILED)
+      THROW_ALERTE("Failed to map [SIZE] bytes of lock file [FILENAME].", AIArgs("[SIZE]", size)("[FILENAME]", m_path));
+    return mapping;
+  }
+
+  void unmap(void* mapping, size_t size) override
+  {
+    munmap(mapping, size);
+  }
+};
+
+} // namespace
+
+std::unique_ptr<FileLockBackend::LockFile> PosixFileLockBackend::open(std::filesystem::path const& path)
+{
+  for (;;)
+  {
+    // Open the file ourselves first, creating it if it doesn't exist, so that we know which inode we opened.
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT)
+    {
+      fd = ::open(path.c_str(), O_RDONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+      if (fd == -1 && errno == EEXIST)
+        continue;       // Created by someone else in the meantime.
+      if (fd != -1)
+        Dout(dc::notice, "Created non-existing lockfile " << path << ".");
+    }
+    if (fd == -1)
+      THROW_ALERTE("Failed to open lock file [FILENAME].", AIArgs("[FILENAME]", path));
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) == -1)
+    {
+      close(fd);
+      THROW_ALERTE("Failed to fstat lock file [FILENAME].", AIArgs("[FILENAME]", path));
+    }
+    inode_id_type const inode_id{statbuf.st_dev, statbuf.st_ino};
+    try
+    {
+      // Open the file lock (this does not lock it).
+      boost::interprocess::file_lock file_lock(path.c_str());
+      // Make sure that the file lock uses the same inode: the file could have been replaced after we opened it.
+      inode_id_type current_inode_id;
+      if (stat(path, current_inode_id) && current_inode_id == inode_id)
+        return std::make_unique<PosixLockFile>(path, std::move(file_lock), fd, inode_id);
+    }
+    catch (boost::interprocess::interprocess_exception& error)
+    {
+      if (error.get_error_code() != boost::interprocess::not_found_error)
+      {
+        close(fd);
+        THROW_ALERTC(error.get_native_error(), "Failed to create file_lock([FILENAME])", AIArgs("[FILENAME]", path));
+      }
+    }
+    // The file was removed or replaced; try again.
+    close(fd);
+  }
+}
+
+bool PosixFileLockBackend::stat(std::filesystem::path const& path, inode_id_type& inode_id)
+{
+  struct stat statbuf;
+  if (::stat(path.c_str(), &statbuf) == -1)
+  {
+    if (errno != ENOENT)
+      Dout(dc::warning, "stat(" << path << "): " << std::strerror(errno));
+    return false;
+  }
+  inode_id = inode_id_type{statbuf.st_dev, statbuf.st_ino};
+  return true;
+}
+
+void PosixFileLockBackend::verify(std::vector<std::pair<std::filesystem::path, inode_id_type>>& entries)
+{
+  // Group the entries by directory, so that every entry costs a single fstatat relative to its directory.
+  std::map<std::filesystem::path, std::vector<std::pair<std::filesystem::path, inode_id_type>>> directories;
+  for (auto& entry : entries)
+    directories[entry.first.parent_path()].emplace_back(entry.first.filename(), entry.second);
+  entries.clear();
+  for (auto const& directory : directories)
+  {
+    int dirfd = ::open(directory.first.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+      continue;
+    for (auto const& entry : directory.second)
+    {
+      struct stat statbuf;
+      if (fstatat(dirfd, entry.first.c_str(), &statbuf, 0) == 0 && inode_id_type(statbuf.st_dev, statbuf.st_ino) == entry.second)
+        entries.emplace_back(directory.first / entry.first, entry.second);
+    }
+    close(dirfd);
+  }
+}
+
+void const* PosixFileLockBackend::lock_owner() const
+{
+  // The locks of real files are owned by the process: all PosixFileLockBackend objects share them.
+  static char const s_process = 0;
+  return &s_process;
+}
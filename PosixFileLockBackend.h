@@ -0,0 +1,40 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class PosixFileLockBackend.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "FileLockBackend.h"
+
+// The default FileLockBackend: real lock files, locked with boost::interprocess::file_lock (fcntl).
+class PosixFileLockBackend : public FileLockBackend
+{
+ public:
+  std::unique_ptr<LockFile> open(std::filesystem::path const& path) override;
+  bool stat(std::filesystem::path const& path, inode_id_type& inode_id) override;
+  void verify(std::vector<std::pair<std::filesystem::path, inode_id_type>>& entries) override;
+  void const* lock_owner() const override;
+};
@@ -0,0 +1,57 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class ScopedBlockingAIStatefulTaskNamedMutex.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "ScopedBlockingAIStatefulTaskNamedMutex.h"
+
+ScopedBlockingAIStatefulTaskNamedMutex::ScopedBlockingAIStatefulTaskNamedMutex(FileLockAccess file_lock_access) :
+  m_task_lock(statefultask::create<task::TaskLock>(std::move(file_lock_access))), m_granted(false)
+{
+  DoutEntering(dc::notice, "ScopedBlockingAIStatefulTaskNamedMutex() [" << this << "]");
+  m_task_lock->set_task_type("ScopedBlockingAIStatefulTaskNamedMutex");
+
+  // Run the task with the immediate handler: it either obtains the lock right away (in this thread),
+  // or it is woken up by (and continues in) the thread that releases the lock before us.
+  m_task_lock->run([this](bool CWDEBUG_ONLY(success)){
+    // TaskLock never aborts (we don't set a deadline).
+    ASSERT(success);
+    std::lock_guard<std::mutex> lock(m_granted_mutex);
+    m_granted = true;
+    m_granted_condition.notify_one();
+  });
+
+  // Go to sleep until the lock was granted.
+  std::unique_lock<std::mutex> lock(m_granted_mutex);
+  m_granted_condition.wait(lock, [this]{ return m_granted; });
+}
+
+ScopedBlockingAIStatefulTaskNamedMutex::~ScopedBlockingAIStatefulTaskNamedMutex()
+{
+  DoutEntering(dc::notice, "~ScopedBlockingAIStatefulTaskNamedMutex() [" << this << "]");
+  m_task_lock->unlock();
+}
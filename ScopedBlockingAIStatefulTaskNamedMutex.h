@@ -0,0 +1,70 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class ScopedBlockingAIStatefulTaskNamedMutex.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "TaskLock.h"
+#include <mutex>
+#include <condition_variable>
+
+// Locking a FileLock from a thread that is not running a task.
+//
+// The constructor blocks the calling thread until the task mutex of the FileLockSingleton
+// (the same one that TaskLock waits for) is obtained; the destructor releases it again.
+//
+// Internally a TaskLock is run with the immediate handler and the thread sleeps on a
+// condition variable until that TaskLock finished; hence blocking threads and tasks
+// are queued in the same FIFO queue and are served in the order that they asked for
+// the lock.
+//
+// Usage:
+//
+//   {
+//     ScopedBlockingAIStatefulTaskNamedMutex lock(file_lock_access);
+//     // ... access the resource protected by file_lock_access ...
+//   } // Unlocked.
+//
+// Do not use this from a task: that would block a thread of the thread pool.
+//
+class ScopedBlockingAIStatefulTaskNamedMutex
+{
+ private:
+  boost::intrusive_ptr<task::TaskLock> m_task_lock;     // The task that waits in the queue on behalf of this thread and owns the lock.
+  std::mutex m_granted_mutex;                           // Protects m_granted.
+  std::condition_variable m_granted_condition;          // Signalled when m_granted is set.
+  bool m_granted;                                       // Set when m_task_lock obtained the lock.
+
+ public:
+  // Block until the task mutex of file_lock_access is obtained.
+  ScopedBlockingAIStatefulTaskNamedMutex(FileLockAccess file_lock_access);
+  // Release the lock.
+  ~ScopedBlockingAIStatefulTaskNamedMutex();
+
+  ScopedBlockingAIStatefulTaskNamedMutex(ScopedBlockingAIStatefulTaskNamedMutex const&) = delete;
+  ScopedBlockingAIStatefulTaskNamedMutex& operator=(ScopedBlockingAIStatefulTaskNamedMutex const&) = delete;
+};
@@ -0,0 +1,73 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Definition of class SemaphoreLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "sys.h"
+#include "SemaphoreLock.h"
+#include <string>
+#include <algorithm>
+
+void SemaphoreLock::set_filename(std::filesystem::path const& filename, int concurrency)
+{
+  // Don't set the filename of a SemaphoreLock twice.
+  ASSERT(m_slots.empty());
+  // There must be at least one slot.
+  ASSERT(concurrency > 0);
+  m_slots.reserve(concurrency);
+  m_slots.push_back(std::make_unique<FileLock>(filename));
+  for (int i = 1; i < concurrency; ++i)
+  {
+    std::filesystem::path slot_filename = filename;
+    slot_filename += ".slot" + std::to_string(i);
+    m_slots.push_back(std::make_unique<FileLock>(slot_filename));
+  }
+}
+
+std::vector<FileLockAccess> SemaphoreLock::obtain_slots(int max_slots)
+{
+  // Call set_filename() first.
+  ASSERT(!m_slots.empty());
+  // Ask for at least one slot.
+  ASSERT(max_slots > 0);
+  std::vector<FileLock*> file_locks;
+  file_locks.reserve(m_slots.size());
+  for (auto& slot : m_slots)
+    file_locks.push_back(slot.get());
+  std::vector<FileLockAccess> slots;
+  // Try the slots in batches of the number of slots that we still need, so that we never take more than max_slots.
+  for (size_t next = 0; next < file_locks.size() && static_cast<int>(slots.size()) < max_slots;)
+  {
+    size_t const count = std::min(static_cast<size_t>(max_slots) - slots.size(), file_locks.size() - next);
+    FileLockAccess::try_lock(&file_locks[next], count, slots);
+    next += count;
+  }
+  Dout(dc::notice, "SemaphoreLock: obtained " << slots.size() << " of the " << m_slots.size() << " slots of " << m_slots[0]->canonical_path() << ".");
+  if (slots.empty())
+    THROW_ALERT("All [CONCURRENCY] slots of [FILENAME] are in use by other processes.",
+        AIArgs("[CONCURRENCY]", m_slots.size())("[FILENAME]", m_slots[0]->canonical_path()));
+  return slots;
+}
@@ -0,0 +1,82 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Declaration of class SemaphoreLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "FileLockAccess.h"
+#include <memory>
+#include <vector>
+
+// class SemaphoreLock
+//
+// A file lock that allows up to `concurrency` users at the same time.
+//
+// A single exclusive FileLock per disk is right for a spinning disk, but wastes the throughput of
+// an SSD that is best used with several requests in flight. A SemaphoreLock consists of `concurrency`
+// slots, each an ordinary FileLock: slot 0 uses the passed filename and slot i uses filename.slot<i>.
+// With a concurrency of 1 a SemaphoreLock is therefore identical to a FileLock of the same filename.
+//
+// Processes divide the slots among themselves: obtain_slots(n) creates a FileLockAccess for
+// up to n slots that aren't held by another process. Tasks of the process then use
+// AnyOfTaskLock over those FileLockAccess objects, so that up to that many tasks proceed at
+// the same time:
+//
+//   SemaphoreLock ssd_lock(lock_filename, 4);  // Or see DeviceLock::get_semaphore.
+//   ...
+//   auto any_of_task_lock = statefultask::create<task::AnyOfTaskLock>(ssd_lock.obtain_slots(2), true);
+//
+// A slot stays taken, also for other processes, for as long as a FileLockAccess of it exists; whether or not
+// a task uses it. Therefore only ask for the number of slots that this process can actually use, and destroy
+// the FileLockAccess objects of the slots that it took but doesn't use, so that they return to the other processes.
+//
+// Just like for FileLock, the lifetime of a SemaphoreLock must exceed that of the FileLockAccess objects created from it.
+//
+class SemaphoreLock
+{
+ private:
+  std::vector<std::unique_ptr<FileLock>> m_slots;
+
+ public:
+  // Default constructor. Use set_filename() to associate the SemaphoreLock with its lock files.
+  SemaphoreLock() { }
+  // Construct a SemaphoreLock with `concurrency` slots, using filename (and filename.slot<i>) as lock files.
+  SemaphoreLock(std::filesystem::path const& filename, int concurrency) { set_filename(filename, concurrency); }
+
+  // Set the lock files to use; at most once. Lock files that don't exist are created.
+  void set_filename(std::filesystem::path const& filename, int concurrency);
+
+  // Return the number of slots.
+  int concurrency() const { return m_slots.size(); }
+
+  // Return the FileLock of slot i.
+  FileLock& slot(int i) { return *m_slots[i]; }
+
+  // Return FileLockAccess objects for up to max_slots (at least one) slots that aren't held by another process.
+  // Throws if every slot is held by another process. Unused slots must be returned (see above).
+  std::vector<FileLockAccess> obtain_slots(int max_slots);
+};
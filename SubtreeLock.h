@@ -0,0 +1,77 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Connect to an end point. Declaration of class SubtreeLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "statefultask/AIStatefulTask.h"
+#include "PathLockTree.h"
+#include "debug.h"
+
+namespace task {
+
+// Lock a whole directory (subtree) at once.
+//
+// While a SubtreeLock with mode X is held for a directory, no TaskLock can obtain a FileLock
+// whose canonical path is inside that directory (and vice versa); mode S only conflicts with
+// X and IX, so it blocks TaskLock (which takes IX on the file) too, but not other S locks.
+//
+class SubtreeLock : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum subtree_lock_state_type {
+    SubtreeLock_lock = direct_base_type::state_end,    // The first state.
+    SubtreeLock_locked
+  };
+
+ private:
+  std::filesystem::path const m_path;                   // The absolute, lexically normal path of the directory.
+  PathLockMode const m_mode;
+
+ public:
+  SubtreeLock(std::filesystem::path const& directory, PathLockMode mode = PathLockMode::X) :
+    AIStatefulTask(CWDEBUG_ONLY(true)), m_path(std::filesystem::absolute(directory).lexically_normal()), m_mode(mode) {
+      DoutEntering(dc::statefultask, "SubtreeLock(" << directory << ", " << mode << ") [" << this << "]"); }
+
+  ~SubtreeLock() { DoutEntering(dc::statefultask, "~SubtreeLock() [" << this << "]"); }
+
+  static state_type constexpr state_end = SubtreeLock_locked + 1;
+
+  void unlock()
+  {
+    PathLockTree::instance().unlock_subtree(m_path, m_mode);
+  }
+
+ private:
+  char const* task_name_impl() const override { return "SubtreeLock"; }
+  char const* state_str_impl(state_type run_state) const final override;
+  void multiplex_impl(state_type run_state) final override;
+};
+
+} // namespace task
@@ -34,6 +34,8 @@ char const* TaskLock::state_str_impl(state_type run_state) const
 {
   switch (run_state)
   {
+    AI_CASE_RETURN(TaskLock_lock_path);
+    AI_CASE_RETURN(TaskLock_queue);
     AI_CASE_RETURN(TaskLock_lock);
     AI_CASE_RETURN(TaskLock_locked);
   }
@@ -41,21 +43,138 @@ char const* TaskLock::state_str_impl(state_type run_state) const
   return "UNKNOWN STATE";
 }
 
+boost::intrusive_ptr<TaskLock> TaskLock::yield_to_waiters(AIStatefulTask* holder, condition_type condition)
+{
+  int expected = granted;
+  [[maybe_unused]] bool success = m_grant_status.compare_exchange_strong(expected, released, std::memory_order_acq_rel);
+  // Only yield while holding the lock.
+  ASSERT(success);
+  if (m_trace_ticket.m_session)
+    LockTrace::release(m_trace_ticket);
+  // Unlock the task mutex, but keep the grant and the path lock: the new TaskLock takes them
+  // over, and requeue passes the grant on atomically.
+  m_file_lock_access.unlock_task();
+  // This task already finished; it can't be run again.
+  boost::intrusive_ptr<TaskLock> task_lock = statefultask::create<TaskLock>(m_file_lock_access);
+  task_lock->m_task_type = m_task_type;
+  task_lock->m_group = m_group;
+  task_lock->m_weight = m_weight;
+  task_lock->m_deadline = m_deadline;
+  task_lock->m_fail_fast = m_fail_fast;
+  task_lock->m_path_tracked = m_path_tracked;
+  task_lock->m_yielding = true;
+  // Start with requeue.
+  task_lock->run(holder, condition);
+  return task_lock;
+}
+
 void TaskLock::multiplex_impl(state_type run_state)
 {
   switch (run_state)
   {
+    case TaskLock_lock_path:
+      if (LockTrace::recording())
+        LockTrace::request(m_trace_ticket, m_file_lock_access.canonical_path(), m_task_type);
+      // First take an intent lock on the path of the file lock, so that we won't get the lock while a SubtreeLock
+      // holds a directory that contains it. This is not an X lock: TaskLock objects of the same file lock must
+      // all reach the waiter queue below, which decides who goes first.
+      set_state(TaskLock_queue);
+      // We already have the path lock when we took over from yield_to_waiters().
+      if (!m_yielding && !PathLockTree::instance().lock_file(this, 1, m_file_lock_access.canonical_path(), m_path_tracked))
+      {
+        wait(1);
+        break;
+      }
+      [[fallthrough]];
+    case TaskLock_queue:
+      // Wait for our turn in the waiter queue of the file lock.
+    {
+      if (m_cancel_status.load(std::memory_order_seq_cst) != not_cancelled)
+      {
+        // Having taken over the grant from yield_to_waiters(), pass it on.
+        if (m_yielding)
+          m_file_lock_access.release_grant();
+        unlock_path();
+        abort();
+        break;
+      }
+      set_state(TaskLock_lock);
+      FileLockQueue::Request const request{this, 1, m_group, m_weight, m_deadline, &m_deadline_missed, m_fail_fast};
+      FileLockQueue::enqueue_result const result = m_yielding ? m_file_lock_access.requeue(request) : m_file_lock_access.enqueue(request);
+      m_yielding = false;
+      switch (result)
+      {
+        case FileLockQueue::granted:
+          break;
+        case FileLockQueue::queued:
+          // If cancel() was called while we were being queued then it might not have found us in the queue.
+          if (m_cancel_status.load(std::memory_order_seq_cst) != not_cancelled && m_file_lock_access.remove_from_queue(this))
+          {
+            m_cancel_status.store(dequeued, std::memory_order_relaxed);
+            unlock_path();
+            abort();
+            return;
+          }
+          // Continue in the thread that passes the grant to us, if requested (see FileLock::set_affinity).
+          if (m_file_lock_access.has_affinity())
+            target(Handler::immediate);
+          wait(1);
+          return;
+        case FileLockQueue::rejected:
+          m_rejected = true;
+          unlock_path();
+          abort();
+          return;
+        case FileLockQueue::deadline_missed:
+          m_deadline_missed = true;
+          unlock_path();
+          abort();
+          return;
+      }
+      [[fallthrough]];
+    }
     case TaskLock_lock:
+      if (m_deadline_missed)
+      {
+        // We were dropped from the queue.
+        unlock_path();
+        abort();
+        break;
+      }
+      if (int cancel_status = m_cancel_status.load(std::memory_order_acquire); cancel_status != not_cancelled)
+      {
+        // If cancel() didn't remove us from the queue then we have the grant: pass it on.
+        if (cancel_status == cancelled)
+          m_file_lock_access.release_grant();
+        unlock_path();
+        abort();
+        break;
+      }
+      // Having the grant, the task mutex is normally free (unless it is also used without TaskLock).
       set_state(TaskLock_locked);
       if (!lock(1))
       {
+        // Continue in the thread that releases the lock to us, if requested (see FileLock::set_affinity).
+        if (m_file_lock_access.has_affinity())
+          target(Handler::immediate);
         wait(1);
         break;
       }
       [[fallthrough]];
     case TaskLock_locked:
+    {
+      if (m_trace_ticket.m_session)
+        LockTrace::acquire(m_trace_ticket);
+      int expected = pending;
+      if (!m_grant_status.compare_exchange_strong(expected, granted, std::memory_order_acq_rel))
+      {
+        // abandon() was called while we were waiting.
+        ASSERT(expected == abandoned);
+        do_unlock();
+      }
       finish();
       break;
+    }
   }
 }
 
@@ -29,7 +29,10 @@
 
 #include "statefultask/AIStatefulTask.h"
 #include "AIStatefulTaskNamedMutex.h"
+#include "PathLockTree.h"
+#include "LockTrace.h"
 #include "debug.h"
+#include <atomic>
 
 namespace task {
 
@@ -39,29 +42,157 @@ class TaskLock : public AIStatefulTask
   using direct_base_type = AIStatefulTask;
 
   enum stateful_task_lock_task_state_type {
-    TaskLock_lock = direct_base_type::state_end,       // The first state.
+    TaskLock_lock_path = direct_base_type::state_end,  // The first state.
+    TaskLock_queue,
+    TaskLock_lock,
     TaskLock_locked
   };
 
  private:
+  enum grant_status_type {
+    pending,            // The lock was not granted yet.
+    granted,            // The lock is held.
+    released,           // The lock was released with unlock().
+    abandoned           // abandon() was called; the lock is released (as soon as it is granted).
+  };
+
+  enum cancel_status_type {
+    not_cancelled,
+    cancelled,          // cancel() was called; the request gives up at the next opportunity.
+    dequeued            // cancel() removed the request from the waiter queue; it will never be granted.
+  };
+
   FileLockAccess m_file_lock_access;
+  std::atomic<int> m_grant_status;
+  std::atomic<int> m_cancel_status;
+  char const* m_task_type;                      // The task type recorded by LockTrace.
+  FileLockQueue::group_id_type m_group;         // The group of this request in the waiter queue (see FileLockQueue).
+  uint32_t m_weight;                            // The weight of that group.
+  FileLockQueue::clock_type::time_point m_deadline;     // The time before which the lock must be granted (see set_deadline).
+  bool m_deadline_missed;                       // Set when the request was dropped because it missed m_deadline.
+  bool m_fail_fast;                             // Abort instead of waiting for admission when the queue is saturated.
+  bool m_rejected;                              // Set when the request was rejected because the queue was saturated.
+  bool m_yielding;                              // Set when this TaskLock took over the grant from yield_to_waiters().
+  bool m_path_tracked;                          // Set when the path lock was taken in the PathLockTree (see PathLockTree::lock_file).
+  LockTrace::Ticket m_trace_ticket;             // The LockTrace state of this request.
 
  public:
-  TaskLock(FileLockAccess const& file_lock_access) :
-    AIStatefulTask(CWDEBUG_ONLY(true)), m_file_lock_access(file_lock_access) {
-      DoutEntering(dc::statefultask, "TaskLock(" << file_lock_access << ") [" << this << "]"); }
+  // Pass an rvalue (std::move) to hand over the reference without touching the lock state.
+  TaskLock(FileLockAccess file_lock_access) :
+    AIStatefulTask(CWDEBUG_ONLY(true)), m_file_lock_access(std::move(file_lock_access)), m_grant_status(pending), m_cancel_status(not_cancelled), m_task_type("unknown"), m_group(0), m_weight(1),
+    m_deadline(FileLockQueue::clock_type::time_point::max()), m_deadline_missed(false),
+    m_fail_fast(false), m_rejected(false), m_yielding(false), m_path_tracked(false) {
+      DoutEntering(dc::statefultask, "TaskLock(" << m_file_lock_access << ") [" << this << "]"); }
 
   ~TaskLock() { DoutEntering(dc::statefultask, "~TaskLock() [" << this << "]"); }
 
   static state_type constexpr state_end = TaskLock_locked + 1;
 
+  // Release the lock. Only call this once the task finished successfully.
   void unlock()
   {
-    m_file_lock_access.unlock_task();
+    int expected = granted;
+    [[maybe_unused]] bool success = m_grant_status.compare_exchange_strong(expected, released, std::memory_order_acq_rel);
+    // Unlocking a lock that isn't held, or unlocking twice.
+    ASSERT(success);
+    do_unlock();
   }
 
+  // Release the lock if it is held, or make sure it will be released as soon as it is granted when it is
+  // still queued. Can be called at any moment (also more than once, or after unlock()).
+  void abandon()
+  {
+    if (m_grant_status.exchange(abandoned, std::memory_order_acq_rel) == granted)
+      do_unlock();
+  }
+
+  // Stop trying to obtain the lock; can be called from any thread, at any moment.
+  // If the request is still waiting in the waiter queue then it is removed from it right away, and the TaskLock
+  // aborts without ever touching the task mutex. If the grant was already passed to it, but the TaskLock didn't
+  // lock the task mutex yet, the grant is passed on and it aborts too. Otherwise the lock is (or will be) obtained
+  // as usual and the TaskLock finishes successfully: then it must still be unlocked.
+  void cancel()
+  {
+    m_cancel_status.store(cancelled, std::memory_order_seq_cst);
+    if (m_file_lock_access.remove_from_queue(this))
+    {
+      m_cancel_status.store(dequeued, std::memory_order_release);
+      signal(1);
+    }
+  }
+
+  // Set the type of the task that uses this lock, as recorded by LockTrace. Call this before running the task.
+  // The string must stay valid for the lifetime of the TaskLock (usually a string literal, or task_name()).
+  void set_task_type(char const* task_type) { m_task_type = task_type; }
+
+  // Set the group (e.g. tenant) of this request and its weight. Call this before running the task.
+  // Groups with waiters get a share of the grants proportional to their weight (see FileLockQueue),
+  // so a group that floods the lock doesn't delay the other groups. The default is group 0, weight 1.
+  // All requests of the same group should use the same weight. The waiter queue remembers every group
+  // that it ever saw, so use a bounded set of groups (e.g. one per tenant).
+  void set_group(FileLockQueue::group_id_type group, uint32_t weight = 1)
+  {
+    // A weight of zero would never be served.
+    ASSERT(weight > 0);
+    m_group = group;
+    m_weight = weight;
+  }
+
+  // Set an absolute deadline for obtaining the lock. Call this before running the task.
+  // Requests with a deadline are granted in earliest-deadline-first order, before requests without one.
+  // If the lock isn't granted before the deadline then the TaskLock is dropped from the queue and aborts
+  // (see FileLockQueue); deadline_missed() returns true then.
+  void set_deadline(FileLockQueue::clock_type::time_point deadline) { m_deadline = deadline; }
+
+  // Return true if this TaskLock aborted because it missed its deadline.
+  bool deadline_missed() const { return m_deadline_missed; }
+
+  // Abort, instead of waiting for admission, when the waiter queue of the file lock is saturated
+  // (see FileLock::set_max_queue_depth). Call this before running the task. rejected() returns true then.
+  void set_fail_fast(bool fail_fast = true) { m_fail_fast = fail_fast; }
+
+  // Return true if this TaskLock aborted because the waiter queue was saturated.
+  bool rejected() const { return m_rejected; }
+
+  // Cooperative yielding, for tasks that hold the lock for a long time.
+  //
+  // should_yield returns true if another request is more urgent than ours: one with an earlier deadline
+  // (see set_deadline), or one that waited longer than max_wait. The holder can then, at a safe point,
+  // call yield_to_waiters: that releases the lock and returns a new TaskLock (with the same settings)
+  // that takes over the grant, lets the current waiters go first (it is queued behind them) and then
+  // obtains the lock again, after which holder is signalled with condition. If nobody is waiting, holder
+  // is signalled right away. This TaskLock is done after that: keep the returned one, and unlock that.
+  // Only call these while holding the lock. For example,
+  //
+  //   case MyTask_work:
+  //     do_some_work();
+  //     if (m_task_lock->should_yield(std::chrono::milliseconds(10)))
+  //     {
+  //       m_task_lock = m_task_lock->yield_to_waiters(this, 2);
+  //       wait(2);
+  //       break;
+  //     }
+  //
+  bool should_yield(std::chrono::nanoseconds max_wait) const { return m_file_lock_access.should_yield(m_deadline, max_wait); }
+  boost::intrusive_ptr<TaskLock> yield_to_waiters(AIStatefulTask* holder, condition_type condition);
+
+  // Return true if the lock is held (granted, and not released or abandoned).
+  bool is_locked() const { return m_grant_status.load(std::memory_order_acquire) == granted; }
+
+  // Accessor.
+  FileLockAccess const& file_lock_access() const { return m_file_lock_access; }
+
  private:
   bool lock(AIStatefulTask::condition_type condition) { return m_file_lock_access.lock_task(this, condition); }
+  void do_unlock()
+  {
+    if (m_trace_ticket.m_session)
+      LockTrace::release(m_trace_ticket);
+    m_file_lock_access.unlock_task();
+    m_file_lock_access.release_grant();
+    unlock_path();
+  }
+  void unlock_path() { PathLockTree::instance().unlock_file(m_file_lock_access.canonical_path(), m_path_tracked); }
   char const* task_name_impl() const override { return "TaskLock"; }
   char const* state_str_impl(state_type run_state) const final override;
   void multiplex_impl(state_type run_state) final override;
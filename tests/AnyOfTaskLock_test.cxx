@@ -0,0 +1,137 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of the winner selection of AnyOfTaskLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "AnyOfTaskLock.h"
+#include "FakeFileLockBackend.h"
+#include "LockDomain.h"
+#include "TestSupport.h"
+#include "debug.h"
+
+namespace {
+
+// Return a TaskLock that holds the task mutex of file_lock.
+boost::intrusive_ptr<task::TaskLock> hold(FileLock& file_lock)
+{
+  boost::intrusive_ptr<task::TaskLock> task_lock = statefultask::create<task::TaskLock>(FileLockAccess(file_lock));
+  task_lock->run(AIStatefulTask::Handler::immediate);
+  CHECK(task_lock->is_locked());
+  return task_lock;
+}
+
+// Run an AnyOfTaskLock over candidates; returns it, and sets locked when it finished successfully.
+boost::intrusive_ptr<task::AnyOfTaskLock> run_any_of(std::vector<FileLockAccess> candidates, bool& locked)
+{
+  locked = false;
+  boost::intrusive_ptr<task::AnyOfTaskLock> any_of_task_lock = statefultask::create<task::AnyOfTaskLock>(std::move(candidates));
+  any_of_task_lock->run([&locked](bool success){ locked = success; }, AIStatefulTask::Handler::immediate);
+  return any_of_task_lock;
+}
+
+// The candidate that is free wins right away; the others are no longer waited for.
+void test_free_candidate_wins(LockDomain& domain)
+{
+  FileLock c0(domain, "/locks/c0"), c1(domain, "/locks/c1"), c2(domain, "/locks/c2");
+  auto holder0 = hold(c0);
+  auto holder1 = hold(c1);
+
+  bool locked;
+  auto any_of_task_lock = run_any_of({FileLockAccess(c0), FileLockAccess(c1), FileLockAccess(c2)}, locked);
+  CHECK(locked);
+  CHECK(any_of_task_lock->locked().canonical_path() == c2.canonical_path());
+  // The losers were removed from the waiter queues: only the holders are left.
+  CHECK(FileLockAccess(c0).task_contention() == 1);
+  CHECK(FileLockAccess(c1).task_contention() == 1);
+
+  any_of_task_lock->unlock();
+  holder0->unlock();
+  holder1->unlock();
+}
+
+// When all candidates are busy, the first one that is released wins.
+void test_first_released_wins(LockDomain& domain)
+{
+  FileLock c0(domain, "/locks/c0"), c1(domain, "/locks/c1"), c2(domain, "/locks/c2");
+  auto holder0 = hold(c0);
+  auto holder1 = hold(c1);
+  auto holder2 = hold(c2);
+
+  bool locked;
+  auto any_of_task_lock = run_any_of({FileLockAccess(c0), FileLockAccess(c1), FileLockAccess(c2)}, locked);
+  CHECK(!locked);
+  CHECK(FileLockAccess(c1).task_contention() == 2);
+  holder1->unlock();
+  CHECK(locked);
+  CHECK(any_of_task_lock->locked().canonical_path() == c1.canonical_path());
+  CHECK(FileLockAccess(c0).task_contention() == 1);
+  CHECK(FileLockAccess(c2).task_contention() == 1);
+
+  // Releasing the other candidates doesn't change the winner.
+  holder0->unlock();
+  holder2->unlock();
+  CHECK(any_of_task_lock->locked().canonical_path() == c1.canonical_path());
+  CHECK(FileLockAccess(c0).task_contention() == 0);
+
+  any_of_task_lock->unlock();
+  CHECK(FileLockAccess(c1).task_contention() == 0);
+}
+
+// The losers don't keep their file lock once the winner is known.
+void test_losers_released(std::shared_ptr<FakeFileSystem> const& file_system, LockDomain& domain)
+{
+  FileLock c0(domain, "/locks/c0"), c1(domain, "/locks/c1");
+  auto holder0 = hold(c0);
+  auto holder1 = hold(c1);
+
+  bool locked;
+  auto any_of_task_lock = run_any_of({FileLockAccess(c0), FileLockAccess(c1)}, locked);
+  holder1->unlock();
+  CHECK(locked);
+  CHECK(any_of_task_lock->locked().canonical_path() == c1.canonical_path());
+
+  // Once the holder of c0 is gone, nobody has c0 anymore; although the AnyOfTaskLock still exists.
+  holder0->unlock();
+  holder0.reset();
+  CHECK(file_system->lock_owner(c0.canonical_path()) == 0);
+  CHECK(file_system->lock_owner(c1.canonical_path()) == 1);
+
+  any_of_task_lock->unlock();
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  LockDomain domain(std::make_shared<FakeFileLockBackend>(file_system, 1));
+
+  test_free_candidate_wins(domain);
+  test_first_released_wins(domain);
+  test_losers_released(file_system, domain);
+}
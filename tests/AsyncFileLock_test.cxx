@@ -0,0 +1,137 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of acquire_async.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "AsyncFileLock.h"
+#include "FakeFileLockBackend.h"
+#include "LockDomain.h"
+#include "TestSupport.h"
+#include "debug.h"
+#include <memory>
+
+namespace {
+
+// Return true if the future is ready; without waiting.
+bool ready(std::future<AsyncFileLock> const& future)
+{
+  return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+// Return true if future holds an AIAlert::Error.
+bool holds_error(std::future<AsyncFileLock>& future)
+{
+  try
+  {
+    future.get();
+  }
+  catch (AIAlert::Error const&)
+  {
+    return true;
+  }
+  return false;
+}
+
+// A free lock is obtained right away; a busy one once it is released.
+void test_acquire(std::shared_ptr<FakeFileSystem> const& file_system, LockDomain& domain)
+{
+  FileLock file_lock(domain, "/locks/a");
+  std::future<AsyncFileLock> first = acquire_async(file_lock);
+  CHECK(ready(first));
+  AsyncFileLock first_lock = first.get();
+  CHECK(first_lock.owns_lock());
+  CHECK(file_system->lock_owner("/locks/a") == 1);
+
+  std::future<AsyncFileLock> second = acquire_async(file_lock);
+  CHECK(!ready(second));
+  first_lock.unlock();
+  CHECK(!first_lock.owns_lock());
+  // The second request was granted by the thread that released the first one.
+  CHECK(ready(second));
+  AsyncFileLock second_lock = second.get();
+  CHECK(second_lock.owns_lock());
+  CHECK(file_system->lock_owner("/locks/a") == 1);
+
+  second_lock.unlock();
+  CHECK(file_system->lock_owner("/locks/a") == 0);
+}
+
+// If another process has the file lock, then the future holds the error of FileLockAccess.
+void test_other_process(LockDomain& domain, LockDomain& theirs)
+{
+  FileLock file_lock(domain, "/locks/b");
+  FileLock their_lock(theirs, "/locks/b");
+  FileLockAccess their_access(their_lock);
+  std::future<AsyncFileLock> future = acquire_async(file_lock);
+  CHECK(ready(future));
+  CHECK(holds_error(future));
+}
+
+// A TaskLock that is rejected, or that misses its deadline, results in an error too.
+void test_rejected_and_deadline(LockDomain& domain)
+{
+  FileLock file_lock(domain, "/locks/c");
+  file_lock.set_max_queue_depth(1);
+  std::future<AsyncFileLock> holder = acquire_async(file_lock);
+  AsyncFileLock holder_lock = holder.get();
+  std::future<AsyncFileLock> waiter = acquire_async(file_lock);
+  CHECK(!ready(waiter));
+
+  // The queue is saturated.
+  auto fail_fast = statefultask::create<task::TaskLock>(FileLockAccess(file_lock));
+  fail_fast->set_fail_fast();
+  std::future<AsyncFileLock> rejected = acquire_async(fail_fast);
+  CHECK(ready(rejected));
+  CHECK(holds_error(rejected));
+  CHECK(fail_fast->rejected() && !fail_fast->deadline_missed());
+
+  // Let the waiter through, so that there is room in the queue again.
+  holder_lock.unlock();
+  AsyncFileLock waiter_lock = waiter.get();
+
+  // The deadline already passed.
+  auto late = statefultask::create<task::TaskLock>(FileLockAccess(file_lock));
+  late->set_deadline(FileLockQueue::clock_type::now() - std::chrono::milliseconds(1));
+  std::future<AsyncFileLock> missed = acquire_async(late);
+  CHECK(ready(missed));
+  CHECK(holds_error(missed));
+  CHECK(late->deadline_missed() && !late->rejected());
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  LockDomain domain(std::make_shared<FakeFileLockBackend>(file_system, 1));
+  LockDomain theirs(std::make_shared<FakeFileLockBackend>(file_system, 2));
+
+  test_acquire(file_system, domain);
+  test_other_process(domain, theirs);
+  test_rejected_and_deadline(domain);
+}
@@ -0,0 +1,120 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of the C-SCAN order of DeviceIOScheduler.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "DeviceIOScheduler.h"
+#include "FakeFileLockBackend.h"
+#include "LockDomain.h"
+#include "TestSupport.h"
+#include "debug.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Return a TaskLock that holds the task mutex of file_lock.
+boost::intrusive_ptr<task::TaskLock> hold(FileLock& file_lock)
+{
+  boost::intrusive_ptr<task::TaskLock> task_lock = statefultask::create<task::TaskLock>(FileLockAccess(file_lock));
+  task_lock->run(AIStatefulTask::Handler::immediate);
+  CHECK(task_lock->is_locked());
+  return task_lock;
+}
+
+// Submit work at each of offsets, while the device lock is held by somebody else; returns the tasks that wait for it.
+std::vector<boost::intrusive_ptr<WaitingTask>> submit(DeviceIOScheduler& scheduler, std::vector<off_t> const& offsets,
+    std::vector<off_t>& executed, std::string& log)
+{
+  std::vector<boost::intrusive_ptr<WaitingTask>> tasks;
+  for (off_t offset : offsets)
+  {
+    tasks.push_back(WaitingTask::start('a' + tasks.size(), log));
+    scheduler.submit(tasks.back().get(), 1, offset, [&executed, offset](){ executed.push_back(offset); });
+  }
+  return tasks;
+}
+
+// Pending requests are executed in ascending offset order, continuing where the previous batch left off.
+void test_elevator_order(LockDomain& domain)
+{
+  FileLock device_lock(domain, "/locks/device");
+  DeviceIOScheduler scheduler{FileLockAccess(device_lock)};
+  std::vector<off_t> executed;
+  std::string log;
+
+  auto holder = hold(device_lock);
+  auto tasks = submit(scheduler, { 50, 10, 90, 30 }, executed, log);
+  CHECK(executed.empty());
+  holder->unlock();
+  CHECK((executed == std::vector<off_t>{ 10, 30, 50, 90 }));
+  // Every submitter was signalled.
+  CHECK(log.size() == 4);
+
+  // The head is at 90 now: the next sweep starts there and wraps around.
+  executed.clear();
+  holder = hold(device_lock);
+  tasks = submit(scheduler, { 20, 95, 60, 90 }, executed, log);
+  holder->unlock();
+  CHECK((executed == std::vector<off_t>{ 90, 95, 20, 60 }));
+}
+
+// A batch executes at most max_batch requests per lock tenure; other users of the lock get a turn in between.
+void test_max_batch(LockDomain& domain)
+{
+  FileLock device_lock(domain, "/locks/device");
+  DeviceIOScheduler scheduler(FileLockAccess(device_lock), 2);
+  std::vector<off_t> executed;
+  std::string log;
+
+  auto holder = hold(device_lock);
+  auto tasks = submit(scheduler, { 40, 30, 20, 10 }, executed, log);
+  // Another user queues behind the batch.
+  auto other = statefultask::create<task::TaskLock>(FileLockAccess(device_lock));
+  other->run(AIStatefulTask::Handler::immediate);
+  CHECK(!other->is_locked());
+
+  holder->unlock();
+  CHECK((executed == std::vector<off_t>{ 10, 20 }));
+  CHECK(other->is_locked());
+
+  other->unlock();
+  CHECK((executed == std::vector<off_t>{ 10, 20, 30, 40 }));
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  LockDomain domain(std::make_shared<FakeFileLockBackend>(file_system, 1));
+
+  test_elevator_order(domain);
+  test_max_batch(domain);
+}
@@ -0,0 +1,107 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of DeviceLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "DeviceLock.h"
+#include "FakeFileLockBackend.h"
+#include "FileLockAccess.h"
+#include "TestSupport.h"
+#include "debug.h"
+#include <memory>
+#include <string>
+#include <sys/sysmacros.h>
+
+namespace {
+
+// The data paths are real (their device is found with stat), but the lock files are fake.
+// Files in /proc are all on the same (virtual) device, which is never the device of the root directory.
+std::filesystem::path const proc_file1 = "/proc/version";
+std::filesystem::path const proc_file2 = "/proc/cpuinfo";
+std::filesystem::path const root_directory = "/";
+
+// Paths on the same device share their lock; paths on another device don't.
+void test_device_mapping()
+{
+  FileLock& lock1 = DeviceLock::get(proc_file1);
+  FileLock& lock2 = DeviceLock::get(proc_file2);
+  CHECK(&lock1 == &lock2);
+  CHECK(&DeviceLock::get(proc_file1) == &lock1);
+
+  dev_t const device = DeviceLock::block_device(proc_file1);
+  CHECK(lock1.canonical_path() == "/locks/device-" + std::to_string(major(device)) + '-' + std::to_string(minor(device)) + ".lock");
+
+  CHECK(DeviceLock::block_device(root_directory) != device);
+  CHECK(&DeviceLock::get(root_directory) != &lock1);
+}
+
+// The path must exist.
+void test_missing_path()
+{
+  bool thrown = false;
+  try
+  {
+    DeviceLock::get("/proc/does/not/exist");
+  }
+  catch (AIAlert::Error const&)
+  {
+    thrown = true;
+  }
+  CHECK(thrown);
+}
+
+// The semaphore of a device uses the lock file of get for its first slot.
+void test_semaphore(std::shared_ptr<FakeFileSystem> const& file_system)
+{
+  DeviceLock::set_concurrency(proc_file1, 3);
+  SemaphoreLock& semaphore = DeviceLock::get_semaphore(proc_file2);
+  CHECK(&DeviceLock::get_semaphore(proc_file1) == &semaphore);
+  CHECK(semaphore.concurrency() == 3);
+  FileLock& lock = DeviceLock::get(proc_file1);
+  CHECK(semaphore.slot(0).canonical_path() == lock.canonical_path());
+
+  // Holding the device lock takes the first slot.
+  FileLockAccess access(lock);
+  std::vector<FileLockAccess> slots = semaphore.obtain_slots(3);
+  CHECK(slots.size() == 3);
+  CHECK(file_system->lock_owner(semaphore.slot(1).canonical_path()) == 1);
+  CHECK(file_system->lock_owner(semaphore.slot(2).canonical_path()) == 1);
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  FileLock::set_backend(std::make_shared<FakeFileLockBackend>(file_system, 1));
+  DeviceLock::set_lock_directory("/locks");
+
+  test_device_mapping();
+  test_missing_path();
+  test_semaphore(file_system);
+}
@@ -0,0 +1,139 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of FakeFileLockBackend: simulated processes, inodes and the lock file header.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FakeFileLockBackend.h"
+#include "FileLockAccess.h"
+#include "LockDomain.h"
+#include "TestSupport.h"
+#include "debug.h"
+#include <memory>
+#include <optional>
+
+namespace {
+
+// Return true if constructing a FileLockAccess for file_lock throws (because another process holds the lock).
+bool access_throws(FileLock& file_lock)
+{
+  try
+  {
+    FileLockAccess access(file_lock);
+  }
+  catch (AIAlert::Error const&)
+  {
+    return true;
+  }
+  return false;
+}
+
+// Two simulated processes exclude each other.
+void test_processes(std::shared_ptr<FakeFileSystem> const& file_system, LockDomain& ours, LockDomain& theirs)
+{
+  FileLock our_lock(ours, "/locks/p");
+  FileLock their_lock(theirs, "/locks/p");
+  CHECK(file_system->lock_owner("/locks/p") == 0);
+  {
+    FileLockAccess access(our_lock);
+    CHECK(file_system->lock_owner("/locks/p") == 1);
+    CHECK(access_throws(their_lock));
+    // The failed attempt didn't change anything.
+    CHECK(file_system->lock_owner("/locks/p") == 1);
+  }
+  CHECK(file_system->lock_owner("/locks/p") == 0);
+  {
+    FileLockAccess access(their_lock);
+    CHECK(file_system->lock_owner("/locks/p") == 2);
+    CHECK(access_throws(our_lock));
+  }
+  CHECK(file_system->lock_owner("/locks/p") == 0);
+}
+
+// Equivalent paths are the same lock; a file that was removed and created again is another one.
+void test_inodes(std::shared_ptr<FakeFileSystem> const& file_system, LockDomain& ours, LockDomain& theirs)
+{
+  file_system->create("/locks/i");
+  CHECK(file_system->link("/locks/i", "/locks/j"));
+  CHECK(!file_system->link("/locks/none", "/locks/k"));
+
+  FileLock lock_i(ours, "/locks/i");
+  FileLock lock_j(ours, "/locks/j");
+  CHECK(lock_j.canonical_path() == lock_i.canonical_path());
+  {
+    FileLockAccess access(lock_i);
+    CHECK(file_system->lock_owner("/locks/j") == 1);
+  }
+
+  // Another process that opens the lock file after it was replaced uses another inode;
+  // while our open lock file keeps the old one.
+  FileLockAccess access(lock_i);
+  file_system->remove("/locks/i");
+  file_system->remove("/locks/j");
+  CHECK(file_system->lock_owner("/locks/i") == 0);
+  FileLock their_lock(theirs, "/locks/i");
+  FileLockAccess their_access(their_lock);
+  CHECK(file_system->lock_owner("/locks/i") == 2);
+}
+
+// The generation counter in the lock file tells whether another process held the lock in between.
+void test_on_acquire(LockDomain& ours, LockDomain& theirs)
+{
+  FileLock our_lock(ours, "/locks/g");
+  FileLock their_lock(theirs, "/locks/g");
+  std::optional<bool> other_process_held_lock;
+  our_lock.set_on_acquire([&other_process_held_lock](bool other){ other_process_held_lock = other; });
+
+  // The first time we don't know.
+  { FileLockAccess access(our_lock); }
+  CHECK(other_process_held_lock && *other_process_held_lock);
+  other_process_held_lock.reset();
+
+  // Nobody else had it.
+  { FileLockAccess access(our_lock); }
+  CHECK(other_process_held_lock && !*other_process_held_lock);
+  other_process_held_lock.reset();
+
+  // The other process had it.
+  { FileLockAccess access(their_lock); }
+  CHECK(!other_process_held_lock);
+  { FileLockAccess access(our_lock); }
+  CHECK(other_process_held_lock && *other_process_held_lock);
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  LockDomain ours(std::make_shared<FakeFileLockBackend>(file_system, 1));
+  LockDomain theirs(std::make_shared<FakeFileLockBackend>(file_system, 2));
+
+  test_processes(file_system, ours, theirs);
+  test_inodes(file_system, ours, theirs);
+  test_on_acquire(ours, theirs);
+}
@@ -0,0 +1,76 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of copying and moving FileLockAccess objects.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FakeFileLockBackend.h"
+#include "FileLockAccess.h"
+#include "LockDomain.h"
+#include "TestSupport.h"
+#include "debug.h"
+#include <memory>
+#include <utility>
+
+namespace {
+
+// The file lock is held until the last copy is gone; moving transfers it.
+void test_copy_and_move(std::shared_ptr<FakeFileSystem> const& file_system, LockDomain& domain)
+{
+  FileLock file_lock(domain, "/locks/a");
+  {
+    FileLockAccess access(file_lock);
+    {
+      FileLockAccess copy(access);
+      FileLockAccess moved(std::move(copy));
+      CHECK(file_system->lock_owner("/locks/a") == 1);
+      // Copying a moved-from object is allowed, and results in another object that doesn't refer to a file lock.
+      FileLockAccess copy_of_moved_from(copy);
+    }
+    CHECK(file_system->lock_owner("/locks/a") == 1);
+  }
+  CHECK(file_system->lock_owner("/locks/a") == 0);
+
+  FileLockAccess access(file_lock);
+  FileLockAccess moved(std::move(access));
+  FileLockAccess copy_of_moved_from(access);
+  CHECK(file_system->lock_owner("/locks/a") == 1);
+  {
+    FileLockAccess last(std::move(moved));
+  }
+  CHECK(file_system->lock_owner("/locks/a") == 0);
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  LockDomain domain(std::make_shared<FakeFileLockBackend>(file_system, 1));
+
+  test_copy_and_move(file_system, domain);
+}
@@ -0,0 +1,254 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of the order in which FileLockQueue passes the grant.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FileLockQueue.h"
+#include "TestSupport.h"
+#include "debug.h"
+#include <vector>
+
+namespace {
+
+using clock_type = FileLockQueue::clock_type;
+
+// Return a request of waiting_task without deadline.
+FileLockQueue::Request request(WaitingTask* waiting_task, FileLockQueue::group_id_type group, uint32_t weight)
+{
+  return { waiting_task, 1, group, weight, clock_type::time_point::max(), nullptr, false };
+}
+
+// Release the grant until nobody is waiting anymore, and then once more by the last waiter.
+void release_all(FileLockQueue& queue)
+{
+  while (queue.size() > 0)
+    queue.release();
+  queue.release();
+}
+
+// Groups get the grant in proportion to their weight, no matter how many requests they queued.
+void test_weighted_fair_order()
+{
+  std::string log;
+  FileLockQueue queue;
+  std::vector<boost::intrusive_ptr<WaitingTask>> tasks;
+
+  auto holder = WaitingTask::start('X', log);
+  CHECK(queue.enqueue(request(holder.get(), 0, 1)) == FileLockQueue::granted);
+  // A group that floods the queue.
+  for (int i = 0; i < 6; ++i)
+  {
+    tasks.push_back(WaitingTask::start('a', log));
+    CHECK(queue.enqueue(request(tasks.back().get(), 1, 1)) == FileLockQueue::queued);
+  }
+  tasks.push_back(WaitingTask::start('b', log));
+  CHECK(queue.enqueue(request(tasks.back().get(), 2, 1)) == FileLockQueue::queued);
+  // A group with twice the weight.
+  for (int i = 0; i < 3; ++i)
+  {
+    tasks.push_back(WaitingTask::start('c', log));
+    CHECK(queue.enqueue(request(tasks.back().get(), 3, 2)) == FileLockQueue::queued);
+  }
+  CHECK(queue.size() == 10);
+
+  release_all(queue);
+  CHECK(log == "abccacaaaa");
+  CHECK(queue.statistics()[1].m_grants == 6);
+  CHECK(queue.statistics()[3].m_grants == 3);
+
+  holder->stop();
+}
+
+// A waiter is dropped when its deadline passes, also when nobody calls the queue anymore.
+void test_deadline_drop()
+{
+  std::string log;
+  FileLockQueue queue;
+
+  auto holder = WaitingTask::start('X', log);
+  CHECK(queue.enqueue(request(holder.get(), 0, 1)) == FileLockQueue::granted);
+  auto waiter = WaitingTask::start('d', log);
+  bool missed = false;
+  CHECK(queue.enqueue({ waiter.get(), 1, 1, 1, clock_type::now() + std::chrono::milliseconds(20), &missed, false }) == FileLockQueue::queued);
+  CHECK(!waiter->signalled());
+
+  // DeadlineTimer drops the waiter.
+  CHECK(waiter->wait_signalled());
+  CHECK(missed);
+  CHECK(queue.size() == 0);
+  CHECK(queue.statistics()[1].m_deadline_misses == 1);
+
+  // A request whose deadline already passed isn't queued at all.
+  auto late = WaitingTask::start('l', log);
+  bool late_missed = false;
+  CHECK(queue.enqueue({ late.get(), 1, 1, 1, clock_type::now() - std::chrono::milliseconds(1), &late_missed, false }) == FileLockQueue::deadline_missed);
+  CHECK(queue.size() == 0);
+
+  queue.release();
+  late->stop();
+  holder->stop();
+  CHECK(log == "dlX");
+}
+
+// A queue can be destroyed while DeadlineTimer has its deadline armed.
+void test_destroy_armed_queue()
+{
+  std::string log;
+  auto holder = WaitingTask::start('X', log);
+  auto waiter = WaitingTask::start('w', log);
+  bool missed = false;
+  {
+    FileLockQueue queue;
+    CHECK(queue.enqueue(request(holder.get(), 0, 1)) == FileLockQueue::granted);
+    CHECK(queue.enqueue({ waiter.get(), 1, 1, 1, clock_type::now() + std::chrono::milliseconds(20), &missed, false }) == FileLockQueue::queued);
+    CHECK(queue.remove(waiter.get()));
+  }
+  // Arm a later deadline on another queue. DeadlineTimer handles deadlines in order, so once
+  // that one fired, the one of the destroyed queue would have fired too.
+  FileLockQueue later_queue;
+  auto later_holder = WaitingTask::start('Y', log);
+  auto later_waiter = WaitingTask::start('v', log);
+  bool later_missed = false;
+  CHECK(later_queue.enqueue(request(later_holder.get(), 0, 1)) == FileLockQueue::granted);
+  CHECK(later_queue.enqueue({ later_waiter.get(), 1, 1, 1, clock_type::now() + std::chrono::milliseconds(40), &later_missed, false }) == FileLockQueue::queued);
+  CHECK(later_waiter->wait_signalled());
+  CHECK(later_missed);
+  CHECK(!missed && !waiter->signalled());
+  later_queue.release();
+  later_holder->stop();
+  waiter->stop();
+  holder->stop();
+}
+
+// Requests that wait for admission are dropped when their deadline passes too, and keep their order otherwise.
+void test_admission_deadline()
+{
+  std::string log;
+  FileLockQueue queue;
+  queue.set_max_depth(1);
+
+  auto holder = WaitingTask::start('X', log);
+  CHECK(queue.enqueue(request(holder.get(), 0, 1)) == FileLockQueue::granted);
+  auto a = WaitingTask::start('a', log);
+  auto b = WaitingTask::start('b', log);
+  auto c = WaitingTask::start('c', log);
+  CHECK(queue.enqueue(request(a.get(), 1, 1)) == FileLockQueue::queued);
+  CHECK(queue.saturated());
+  // b waits for admission; it doesn't have to report that it missed its deadline.
+  CHECK(queue.enqueue({ b.get(), 1, 1, 1, clock_type::now() + std::chrono::milliseconds(20), nullptr, false }) == FileLockQueue::queued);
+  CHECK(queue.enqueue(request(c.get(), 1, 1)) == FileLockQueue::queued);
+  CHECK(queue.size() == 3);
+
+  CHECK(b->wait_signalled());
+  CHECK(queue.size() == 2);
+  release_all(queue);
+  CHECK(log == "bac");
+  holder->stop();
+}
+
+// Requests with a deadline go first, earliest deadline first.
+void test_earliest_deadline_first()
+{
+  std::string log;
+  FileLockQueue queue;
+  auto const now = clock_type::now();
+
+  auto holder = WaitingTask::start('X', log);
+  CHECK(queue.enqueue(request(holder.get(), 0, 1)) == FileLockQueue::granted);
+  auto a = WaitingTask::start('a', log);
+  auto b = WaitingTask::start('b', log);
+  auto c = WaitingTask::start('c', log);
+  bool missed = false;
+  CHECK(queue.enqueue(request(a.get(), 1, 1)) == FileLockQueue::queued);
+  CHECK(queue.enqueue({ b.get(), 1, 1, 1, now + std::chrono::hours(2), &missed, false }) == FileLockQueue::queued);
+  CHECK(queue.enqueue({ c.get(), 1, 1, 1, now + std::chrono::hours(1), &missed, false }) == FileLockQueue::queued);
+
+  release_all(queue);
+  CHECK(log == "cba");
+  CHECK(!missed);
+  holder->stop();
+}
+
+// Requeueing passes the grant on and puts the holder behind everyone who is waiting.
+void test_requeue()
+{
+  std::string log;
+  FileLockQueue queue;
+
+  auto holder = WaitingTask::start('X', log);
+  CHECK(queue.enqueue(request(holder.get(), 0, 1)) == FileLockQueue::granted);
+  // Nobody to yield to: the holder keeps the grant.
+  CHECK(queue.requeue(request(holder.get(), 0, 1)) == FileLockQueue::granted);
+  CHECK(log.empty());
+
+  auto a = WaitingTask::start('a', log);
+  auto b = WaitingTask::start('b', log);
+  CHECK(queue.enqueue(request(a.get(), 1, 1)) == FileLockQueue::queued);
+  CHECK(queue.enqueue(request(b.get(), 2, 1)) == FileLockQueue::queued);
+  CHECK(queue.requeue(request(holder.get(), 0, 1)) == FileLockQueue::queued);
+  CHECK(log == "a");
+  CHECK(queue.size() == 2);
+
+  release_all(queue);
+  CHECK(log == "abX");
+}
+
+// A removed request is never granted.
+void test_remove()
+{
+  std::string log;
+  FileLockQueue queue;
+
+  auto holder = WaitingTask::start('X', log);
+  CHECK(queue.enqueue(request(holder.get(), 0, 1)) == FileLockQueue::granted);
+  auto a = WaitingTask::start('a', log);
+  auto b = WaitingTask::start('b', log);
+  CHECK(queue.enqueue(request(a.get(), 1, 1)) == FileLockQueue::queued);
+  CHECK(queue.enqueue(request(b.get(), 1, 1)) == FileLockQueue::queued);
+  CHECK(queue.remove(a.get()));
+  CHECK(!queue.remove(a.get()));
+  CHECK(!queue.remove(holder.get()));
+
+  release_all(queue);
+  CHECK(log == "b");
+  a->stop();
+  holder->stop();
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  test_weighted_fair_order();
+  test_deadline_drop();
+  test_destroy_armed_queue();
+  test_admission_deadline();
+  test_earliest_deadline_first();
+  test_requeue();
+  test_remove();
+}
@@ -0,0 +1,142 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of LockDomain: its registry, statistics and handles.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FakeFileLockBackend.h"
+#include "FileLockAccess.h"
+#include "LockDomain.h"
+#include "TestSupport.h"
+#include "debug.h"
+#include <memory>
+
+namespace {
+
+// Two domains with the same lock owner can't use the same lock file.
+void test_same_lock_file(std::shared_ptr<FakeFileSystem> const& file_system)
+{
+  auto backend = std::make_shared<FakeFileLockBackend>(file_system, 1);
+  LockDomain domain1(backend);
+  LockDomain domain2(backend);
+  file_system->create("/locks/a");
+  CHECK(file_system->link("/locks/a", "/locks/b"));
+
+  FileLock file_lock(domain1, "/locks/a");
+  FileLockAccess access(file_lock);
+  bool thrown = false;
+  try
+  {
+    // An equivalent path.
+    FileLock other(domain2, "/locks/b");
+  }
+  catch (AIAlert::Error const&)
+  {
+    thrown = true;
+  }
+  CHECK(thrown);
+  // The lock of domain1 was left alone.
+  CHECK(file_system->lock_owner("/locks/a") == 1);
+
+  // Other lock files can still be used by domain2.
+  FileLock other(domain2, "/locks/c");
+  FileLockAccess other_access(other);
+  CHECK(file_system->lock_owner("/locks/c") == 1);
+}
+
+// A domain with another lock owner (e.g. a simulated process) can use the same lock file.
+void test_other_lock_owner(std::shared_ptr<FakeFileSystem> const& file_system)
+{
+  LockDomain ours(std::make_shared<FakeFileLockBackend>(file_system, 1));
+  LockDomain theirs(std::make_shared<FakeFileLockBackend>(file_system, 2));
+
+  FileLock our_lock(ours, "/locks/d");
+  FileLock their_lock(theirs, "/locks/d");
+  FileLockAccess access(their_lock);
+  CHECK(file_system->lock_owner("/locks/d") == 2);
+}
+
+// Once the FileLock objects of a domain are gone, another domain can use the lock file.
+void test_reuse_after_release(std::shared_ptr<FakeFileSystem> const& file_system)
+{
+  auto backend = std::make_shared<FakeFileLockBackend>(file_system, 1);
+  LockDomain domain1(backend);
+  LockDomain domain2(backend);
+  {
+    FileLock file_lock(domain1, "/locks/e");
+  }
+  FileLock file_lock(domain2, "/locks/e");
+  FileLockAccess access(file_lock);
+  CHECK(file_system->lock_owner("/locks/e") == 1);
+}
+
+// Every domain has its own registry, statistics and handles.
+void test_independent_domains(std::shared_ptr<FakeFileSystem> const& file_system)
+{
+  LockDomain domain1(std::make_shared<FakeFileLockBackend>(file_system, 1));
+  LockDomain domain2(std::make_shared<FakeFileLockBackend>(file_system, 2));
+  file_system->create("/locks/f");
+  CHECK(file_system->link("/locks/f", "/locks/g"));
+
+  FileLock f1(domain1, "/locks/f");
+  FileLock f1_again(domain1, "/locks/f");      // Same path.
+  FileLock g1(domain1, "/locks/g");            // Equivalent path.
+  FileLock h2(domain2, "/locks/h");
+  LockDomain::Statistics statistics1 = domain1.statistics();
+  CHECK(statistics1.m_lookups == 3);
+  CHECK(statistics1.m_path_hits == 1);
+  CHECK(statistics1.m_inode_hits == 1);
+  CHECK(statistics1.m_created == 1);
+  CHECK(statistics1.m_registered == 1);
+  LockDomain::Statistics statistics2 = domain2.statistics();
+  CHECK(statistics2.m_lookups == 1);
+  CHECK(statistics2.m_created == 1);
+
+  // Both domains start handing out handles at index 0.
+  LockHandle handle1 = domain1.handle(g1);
+  LockHandle handle2 = domain2.handle(h2);
+  CHECK(handle1.index() == 0 && handle2.index() == 0);
+  CHECK(domain1.instance(handle1).canonical_path() == f1.canonical_path());
+  CHECK(domain2.instance(handle2).canonical_path() == h2.canonical_path());
+
+  FileLockAccess access1(domain1, handle1);
+  FileLockAccess access2(domain2, handle2);
+  CHECK(file_system->lock_owner("/locks/f") == 1);
+  CHECK(file_system->lock_owner("/locks/h") == 2);
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+
+  test_same_lock_file(file_system);
+  test_other_lock_owner(file_system);
+  test_reuse_after_release(file_system);
+  test_independent_domains(file_system);
+}
@@ -0,0 +1,101 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of the dense lock handles of LockDomain.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FakeFileLockBackend.h"
+#include "FileLockAccess.h"
+#include "LockDomain.h"
+#include "TestSupport.h"
+#include "debug.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Equivalent paths share a handle, and a handle stays valid after the FileLock objects are gone.
+void test_handle_lifetime(std::shared_ptr<FakeFileSystem> const& file_system, LockDomain& domain)
+{
+  file_system->create("/locks/a");
+  CHECK(file_system->link("/locks/a", "/locks/b"));
+  uint32_t const number_of_handles = domain.number_of_handles();
+
+  LockHandle handle;
+  {
+    FileLock file_lock_a(domain, "/locks/a");
+    FileLock file_lock_b(domain, "/locks/b");
+    handle = domain.handle(file_lock_a);
+    CHECK(domain.handle(file_lock_b) == handle);
+    CHECK(domain.handle(file_lock_a) == handle);
+    CHECK(domain.number_of_handles() == number_of_handles + 1);
+  }
+
+  // The file lock stays registered: a new FileLock gets the same handle.
+  {
+    FileLock file_lock_a(domain, "/locks/a");
+    CHECK(domain.handle(file_lock_a) == handle);
+    CHECK(domain.number_of_handles() == number_of_handles + 1);
+  }
+
+  // A FileLockAccess created from the handle locks the file.
+  {
+    FileLockAccess access(domain, handle);
+    CHECK(file_system->lock_owner("/locks/a") == 1);
+  }
+  CHECK(file_system->lock_owner("/locks/a") == 0);
+}
+
+// The handles of many file locks, spread over several chunks, are dense and map back to their file lock.
+void test_many_handles(LockDomain& domain)
+{
+  constexpr size_t count = 1000;
+  uint32_t const first_index = domain.number_of_handles();
+
+  std::vector<std::unique_ptr<FileLock>> file_locks;
+  for (size_t i = 0; i < count; ++i)
+  {
+    file_locks.push_back(std::make_unique<FileLock>(domain, "/locks/many" + std::to_string(i)));
+    CHECK(domain.handle(*file_locks.back()).index() == first_index + i);
+  }
+  CHECK(domain.number_of_handles() == first_index + count);
+
+  for (size_t i = 0; i < count; ++i)
+    CHECK(domain.instance(LockHandle{static_cast<uint32_t>(first_index + i)}).canonical_path() == file_locks[i]->canonical_path());
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  LockDomain domain(std::make_shared<FakeFileLockBackend>(file_system, 1));
+
+  test_handle_lifetime(file_system, domain);
+  test_many_handles(domain);
+}
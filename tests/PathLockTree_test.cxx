@@ -0,0 +1,167 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of the compatibility of the modes of PathLockTree.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "PathLockTree.h"
+#include "TestSupport.h"
+#include "debug.h"
+
+namespace {
+
+// S is compatible with S, but not with X.
+void test_subtree_modes()
+{
+  std::string log;
+  PathLockTree tree;
+  auto s1 = WaitingTask::start('s', log);
+  auto s2 = WaitingTask::start('t', log);
+  auto x = WaitingTask::start('x', log);
+
+  CHECK(tree.lock_subtree(s1.get(), 1, "/d", PathLockMode::S));
+  CHECK(tree.lock_subtree(s2.get(), 1, "/d", PathLockMode::S));
+  CHECK(!tree.lock_subtree(x.get(), 1, "/d", PathLockMode::X));
+  tree.unlock_subtree("/d", PathLockMode::S);
+  CHECK(!x->signalled());
+  tree.unlock_subtree("/d", PathLockMode::S);
+  CHECK(x->signalled());
+  tree.unlock_subtree("/d", PathLockMode::X);
+  CHECK(log == "x");
+
+  s1->stop();
+  s2->stop();
+}
+
+// A subtree lock conflicts with the (IX) lock of a file inside it, but not with files elsewhere.
+void test_subtree_and_files()
+{
+  std::string log;
+  PathLockTree tree;
+  auto x = WaitingTask::start('x', log);
+  auto inside = WaitingTask::start('i', log);
+  auto outside = WaitingTask::start('o', log);
+  bool inside_tracked, outside_tracked;
+
+  CHECK(tree.lock_subtree(x.get(), 1, "/d", PathLockMode::X));
+  CHECK(!tree.lock_file(inside.get(), 1, "/d/sub/file", inside_tracked));
+  CHECK(tree.lock_file(outside.get(), 1, "/e/file", outside_tracked));
+  CHECK(inside_tracked && outside_tracked);
+  tree.unlock_file("/e/file", outside_tracked);
+  tree.unlock_subtree("/d", PathLockMode::X);
+  CHECK(inside->signalled());
+  tree.unlock_file("/d/sub/file", inside_tracked);
+
+  x->stop();
+  outside->stop();
+}
+
+// File locks (IX) are compatible with each other, also on the same path, but not with S on an ancestor.
+void test_files_and_shared_subtree()
+{
+  std::string log;
+  PathLockTree tree;
+  auto z = WaitingTask::start('z', log);
+  auto f1 = WaitingTask::start('f', log);
+  auto f2 = WaitingTask::start('g', log);
+  auto s = WaitingTask::start('s', log);
+  bool tracked1, tracked2;
+
+  // Make the file locks go through the tree.
+  CHECK(tree.lock_subtree(z.get(), 1, "/z", PathLockMode::S));
+  CHECK(tree.lock_file(f1.get(), 1, "/d/file", tracked1));
+  CHECK(tree.lock_file(f2.get(), 1, "/d/file", tracked2));
+  CHECK(!tree.lock_subtree(s.get(), 1, "/d", PathLockMode::S));
+  tree.unlock_file("/d/file", tracked1);
+  CHECK(!s->signalled());
+  tree.unlock_file("/d/file", tracked2);
+  CHECK(s->signalled());
+  tree.unlock_subtree("/d", PathLockMode::S);
+  tree.unlock_subtree("/z", PathLockMode::S);
+
+  z->stop();
+  f1->stop();
+  f2->stop();
+}
+
+// A lock inside a directory puts an intent lock on the directory; conflicting requests are granted in FIFO order.
+void test_intent_locks()
+{
+  std::string log;
+  PathLockTree tree;
+  auto inner = WaitingTask::start('i', log);
+  auto x = WaitingTask::start('x', log);
+  auto s = WaitingTask::start('s', log);
+
+  CHECK(tree.lock_subtree(inner.get(), 1, "/d/sub", PathLockMode::S));
+  // IS on /d conflicts with X on /d.
+  CHECK(!tree.lock_subtree(x.get(), 1, "/d", PathLockMode::X));
+  // IS is compatible with S, but S may not overtake the X that waits before it.
+  CHECK(!tree.lock_subtree(s.get(), 1, "/d", PathLockMode::S));
+  tree.unlock_subtree("/d/sub", PathLockMode::S);
+  CHECK(x->signalled() && !s->signalled());
+  tree.unlock_subtree("/d", PathLockMode::X);
+  CHECK(s->signalled());
+  tree.unlock_subtree("/d", PathLockMode::S);
+  CHECK(log == "xs");
+
+  inner->stop();
+}
+
+// Without subtree locks, file locks skip the tree; a subtree lock waits until those are released.
+void test_untracked_files()
+{
+  std::string log;
+  PathLockTree tree;
+  auto f = WaitingTask::start('f', log);
+  auto s = WaitingTask::start('s', log);
+  bool tracked;
+
+  CHECK(tree.lock_file(f.get(), 1, "/q/file", tracked));
+  CHECK(!tracked);
+  CHECK(!tree.lock_subtree(s.get(), 1, "/elsewhere", PathLockMode::S));
+  tree.unlock_file("/q/file", tracked);
+  CHECK(s->signalled());
+  tree.unlock_subtree("/elsewhere", PathLockMode::S);
+  // Once the last subtree lock is gone, file locks skip the tree again.
+  CHECK(tree.lock_file(f.get(), 1, "/q/file", tracked));
+  CHECK(!tracked);
+  tree.unlock_file("/q/file", tracked);
+
+  f->stop();
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  test_subtree_modes();
+  test_subtree_and_files();
+  test_files_and_shared_subtree();
+  test_intent_locks();
+  test_untracked_files();
+}
@@ -0,0 +1,87 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of FileLock::query_holder.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FakeFileLockBackend.h"
+#include "FileLockAccess.h"
+#include "LockDomain.h"
+#include "TestSupport.h"
+#include "debug.h"
+#include <memory>
+#include <unistd.h>
+
+namespace {
+
+// query_holder reports who holds a file lock, without changing anything.
+void test_query_holder(std::shared_ptr<FakeFileSystem> const& file_system, LockDomain& ours, LockDomain& theirs)
+{
+  FileLock our_lock(ours, "/locks/q");
+  FileLock their_lock(theirs, "/locks/q");
+  pid_t pid = -1;
+
+  CHECK(our_lock.query_holder(pid) == FileLock::not_locked);
+  CHECK(pid == 0);
+  CHECK(!our_lock.is_locked_elsewhere());
+  // Querying didn't lock it.
+  CHECK(file_system->lock_owner("/locks/q") == 0);
+
+  {
+    FileLockAccess access(our_lock);
+    CHECK(our_lock.query_holder(pid) == FileLock::locked_by_this_process);
+    CHECK(pid == getpid());
+    CHECK(!our_lock.is_locked_elsewhere());
+    // The other process sees us (as simulated process 1).
+    CHECK(their_lock.query_holder(pid) == FileLock::locked_by_other_process);
+    CHECK(pid == 1);
+    CHECK(their_lock.is_locked_elsewhere());
+  }
+
+  {
+    FileLockAccess access(their_lock);
+    CHECK(our_lock.query_holder(pid) == FileLock::locked_by_other_process);
+    CHECK(pid == 2);
+    CHECK(our_lock.is_locked_elsewhere());
+  }
+
+  // Still nothing changed by the queries: the lock can be obtained.
+  CHECK(our_lock.query_holder(pid) == FileLock::not_locked);
+  FileLockAccess access(our_lock);
+  CHECK(file_system->lock_owner("/locks/q") == 1);
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  LockDomain ours(std::make_shared<FakeFileLockBackend>(file_system, 1));
+  LockDomain theirs(std::make_shared<FakeFileLockBackend>(file_system, 2));
+
+  test_query_holder(file_system, ours, theirs);
+}
@@ -0,0 +1,169 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of recursive mode: one FileLockHolder locking the same file more than once.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FakeFileLockBackend.h"
+#include "FileLockHolder.h"
+#include "LockDomain.h"
+#include "TestSupport.h"
+#include "debug.h"
+
+namespace {
+
+// A FileLockHolder that is driven by the test: it counts how often it is signalled, until it is stopped.
+class TestHolder : public task::FileLockHolder
+{
+ protected:
+  using direct_base_type = task::FileLockHolder;
+
+  enum test_holder_state_type {
+    TestHolder_start = direct_base_type::state_end,
+    TestHolder_signalled
+  };
+
+ private:
+  int m_signals;
+  bool m_stop;
+
+ public:
+  static state_type constexpr state_end = TestHolder_signalled + 1;
+
+  TestHolder() : FileLockHolder(CWDEBUG_ONLY(true)), m_signals(0), m_stop(false) { }
+
+  using FileLockHolder::lock_file;
+  using FileLockHolder::unlock_file;
+
+  // Return the number of times that this task was signalled.
+  int signals() const { return m_signals; }
+
+  // Finish the task (which releases all its locks).
+  void stop()
+  {
+    m_stop = true;
+    signal(1);
+  }
+
+ private:
+  char const* task_name_impl() const override { return "TestHolder"; }
+
+  char const* state_str_impl(state_type run_state) const final override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(TestHolder_start);
+      AI_CASE_RETURN(TestHolder_signalled);
+    }
+    return "UNKNOWN STATE";
+  }
+
+  void multiplex_impl(state_type run_state) final override
+  {
+    switch (run_state)
+    {
+      case TestHolder_start:
+        set_state(TestHolder_signalled);
+        wait(1);
+        break;
+      case TestHolder_signalled:
+        if (m_stop)
+        {
+          finish();
+          break;
+        }
+        ++m_signals;
+        wait(1);
+        break;
+    }
+  }
+};
+
+boost::intrusive_ptr<TestHolder> start_holder()
+{
+  boost::intrusive_ptr<TestHolder> holder = statefultask::create<TestHolder>();
+  holder->run(AIStatefulTask::Handler::immediate);
+  return holder;
+}
+
+// The same holder locks a file twice through one TaskLock; only the matching final unlock_file releases it.
+void test_lock_twice(LockDomain& domain)
+{
+  FileLock file_lock(domain, "/locks/recursive");
+  file_lock.set_recursive(true);
+
+  auto holder = start_holder();
+  auto other = start_holder();
+  task::TaskLock& first = holder->lock_file(FileLockAccess(file_lock), 1);
+  CHECK(holder->signals() == 1);
+  CHECK(first.is_locked());
+  task::TaskLock& second = holder->lock_file(FileLockAccess(file_lock), 1);
+  CHECK(holder->signals() == 2);
+  CHECK(&second == &first);
+  CHECK(FileLockAccess(file_lock).task_contention() == 1);
+
+  other->lock_file(FileLockAccess(file_lock), 1);
+  CHECK(other->signals() == 0);
+  holder->unlock_file(second);
+  CHECK(other->signals() == 0);
+  CHECK(first.is_locked());
+  holder->unlock_file(first);
+  CHECK(other->signals() == 1);
+
+  other->stop();
+  holder->stop();
+  CHECK(FileLockAccess(file_lock).task_contention() == 0);
+}
+
+// Finishing releases a lock that was obtained more than once.
+void test_finish_releases(LockDomain& domain)
+{
+  FileLock file_lock(domain, "/locks/recursive");
+  file_lock.set_recursive(true);
+
+  auto holder = start_holder();
+  auto other = start_holder();
+  holder->lock_file(FileLockAccess(file_lock), 1);
+  holder->lock_file(FileLockAccess(file_lock), 1);
+  other->lock_file(FileLockAccess(file_lock), 1);
+  CHECK(other->signals() == 0);
+  holder->stop();
+  CHECK(other->signals() == 1);
+  other->stop();
+  CHECK(FileLockAccess(file_lock).task_contention() == 0);
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  LockDomain domain(std::make_shared<FakeFileLockBackend>(file_system, 1));
+
+  test_lock_twice(domain);
+  test_finish_releases(domain);
+}
@@ -0,0 +1,92 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of TaskLock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FakeFileLockBackend.h"
+#include "LockDomain.h"
+#include "TaskLock.h"
+#include "TestSupport.h"
+#include "debug.h"
+
+namespace {
+
+// Run a TaskLock of file_lock that signals parent once it has the lock.
+boost::intrusive_ptr<task::TaskLock> run_task_lock(FileLock& file_lock, AIStatefulTask* parent)
+{
+  boost::intrusive_ptr<task::TaskLock> task_lock = statefultask::create<task::TaskLock>(FileLockAccess(file_lock));
+  task_lock->run(parent, 1);
+  return task_lock;
+}
+
+// yield_to_waiters lets the current waiters go first, and then obtains the lock again in a new TaskLock.
+void test_yield_to_waiters(LockDomain& domain)
+{
+  std::string log;
+  FileLock file_lock(domain, "/locks/yield");
+
+  auto holder = WaitingTask::start('h', log);
+  auto holder_lock = run_task_lock(file_lock, holder.get());
+  CHECK(holder->signalled());
+  CHECK(holder_lock->is_locked());
+  auto waiter = WaitingTask::start('w', log);
+  auto waiter_lock = run_task_lock(file_lock, waiter.get());
+  CHECK(!waiter->signalled());
+  CHECK(holder_lock->should_yield(std::chrono::nanoseconds(0)));
+
+  auto again = WaitingTask::start('a', log);
+  auto again_lock = holder_lock->yield_to_waiters(again.get(), 1);
+  CHECK(again_lock != holder_lock);
+  CHECK(!holder_lock->is_locked());
+  CHECK(waiter->signalled());
+  CHECK(waiter_lock->is_locked());
+  CHECK(!again->signalled());
+
+  waiter_lock->unlock();
+  CHECK(again->signalled());
+  CHECK(again_lock->is_locked());
+  CHECK(log == "hwa");
+
+  // Nobody is waiting: the lock is obtained again right away.
+  auto alone = WaitingTask::start('b', log);
+  auto alone_lock = again_lock->yield_to_waiters(alone.get(), 1);
+  CHECK(alone->signalled());
+  CHECK(alone_lock->is_locked());
+  alone_lock->unlock();
+  CHECK(FileLockAccess(file_lock).task_contention() == 0);
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  LockDomain domain(std::make_shared<FakeFileLockBackend>(file_system, 1));
+
+  test_yield_to_waiters(domain);
+}
@@ -0,0 +1,139 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Helpers of the tests: CHECK, wait_for and class WaitingTask.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "statefultask/AIStatefulTask.h"
+#include "debug.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+// Stop the test with a message if condition doesn't hold (also in non-debug builds, unlike ASSERT).
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) \
+    { \
+      std::cerr << __FILE__ << ':' << __LINE__ << ": CHECK(" #condition ") failed." << std::endl; \
+      std::exit(EXIT_FAILURE); \
+    } \
+  } while (0)
+
+// A task that waits until it is signalled with condition 1, then appends its name to a log and finishes.
+//
+// The tests pass these as the task that is signalled by a queue or a mutex, so that the order
+// in which they are signalled can be checked. They run with the immediate handler: in the
+// thread that runs them, or that signals them. A test can wait for a task that is signalled
+// by another thread (e.g. by DeadlineTimer) with wait_signalled.
+//
+class WaitingTask : public AIStatefulTask
+{
+ protected:
+  using direct_base_type = AIStatefulTask;
+
+  enum waiting_task_state_type {
+    WaitingTask_wait = direct_base_type::state_end,
+    WaitingTask_signalled
+  };
+
+ private:
+  char const m_name;
+  std::string& m_log;
+  mutable std::mutex m_mutex;
+  std::condition_variable m_condition;                  // Notified when m_signalled is set.
+  bool m_signalled;                                     // Protected by m_mutex.
+
+ public:
+  static state_type constexpr state_end = WaitingTask_signalled + 1;
+
+  WaitingTask(char name, std::string& log) : AIStatefulTask(CWDEBUG_ONLY(true)), m_name(name), m_log(log), m_signalled(false) { }
+
+  // Create a WaitingTask and run it; it then waits until it is signalled.
+  static boost::intrusive_ptr<WaitingTask> start(char name, std::string& log)
+  {
+    boost::intrusive_ptr<WaitingTask> waiting_task = statefultask::create<WaitingTask>(name, log);
+    waiting_task->run(Handler::immediate);
+    return waiting_task;
+  }
+
+  // Return true once the task was signalled.
+  bool signalled() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_signalled;
+  }
+
+  // Block until the task was signalled. Returns false if that didn't happen within timeout.
+  bool wait_signalled(std::chrono::milliseconds timeout = std::chrono::milliseconds(1000))
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_condition.wait_for(lock, timeout, [this](){ return m_signalled; });
+  }
+
+  // Let the task finish if it wasn't signalled yet (e.g. because it obtained a lock right away).
+  void stop()
+  {
+    if (!signalled())
+      signal(1);
+  }
+
+ private:
+  char const* task_name_impl() const override { return "WaitingTask"; }
+
+  char const* state_str_impl(state_type run_state) const final override
+  {
+    switch (run_state)
+    {
+      AI_CASE_RETURN(WaitingTask_wait);
+      AI_CASE_RETURN(WaitingTask_signalled);
+    }
+    return "UNKNOWN STATE";
+  }
+
+  void multiplex_impl(state_type run_state) final override
+  {
+    switch (run_state)
+    {
+      case WaitingTask_wait:
+        set_state(WaitingTask_signalled);
+        wait(1);
+        break;
+      case WaitingTask_signalled:
+        m_log += m_name;
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_signalled = true;
+        }
+        m_condition.notify_all();
+        finish();
+        break;
+    }
+  }
+};
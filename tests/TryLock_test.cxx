@@ -0,0 +1,104 @@
+/**
+ * filelock-task -- A statefultask-based file lock task.
+ *
+ * @file
+ * @brief Test of the bitmap returned by FileLockAccess::try_lock.
+ *
+ * @Copyright (C) 2019  Carlo Wood.
+ *
+ * RSA-1024 0x624ACAD5 1997-01-26                    Sign & Encrypt
+ * Fingerprint16 = 32 EC A7 B6 AC DB 65 A6  F6 F6 55 DD 1C DC FF 61
+ *
+ * This file is part of filelock-task.
+ *
+ * Filelock-task is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Filelock-task is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with filelock-task.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sys.h"
+#include "FakeFileLockBackend.h"
+#include "FileLockAccess.h"
+#include "LockDomain.h"
+#include "TestSupport.h"
+#include "debug.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr size_t number_of_locks = 70;          // More than fit in one word of the bitmap.
+
+std::filesystem::path lock_path(size_t i)
+{
+  return "/locks/" + std::to_string(i);
+}
+
+// try_lock obtains every file lock that isn't held by another process, and nothing else.
+void test_bitmap(std::shared_ptr<FakeFileSystem> const& file_system, LockDomain& ours, LockDomain& theirs)
+{
+  std::vector<std::unique_ptr<FileLock>> file_locks;
+  std::vector<FileLock*> file_lock_ptrs;
+  for (size_t i = 0; i < number_of_locks; ++i)
+  {
+    file_locks.push_back(std::make_unique<FileLock>(ours, lock_path(i)));
+    file_lock_ptrs.push_back(file_locks.back().get());
+  }
+
+  {
+    // Let another process hold two of the locks: one in each word of the bitmap.
+    FileLock their1(theirs, lock_path(1));
+    FileLock their65(theirs, lock_path(65));
+    FileLockAccess their_access1(their1);
+    FileLockAccess their_access65(their65);
+    CHECK(file_system->lock_owner(lock_path(1)) == 2);
+
+    std::vector<FileLockAccess> accesses;
+    {
+      std::vector<uint64_t> bitmap = FileLockAccess::try_lock(file_lock_ptrs.data(), number_of_locks, accesses);
+      CHECK(bitmap.size() == 2);
+      CHECK(bitmap[0] == (~uint64_t{0} & ~uint64_t{2}));
+      CHECK(bitmap[1] == 0x3d);
+      CHECK(accesses.size() == number_of_locks - 2);
+      CHECK(file_system->lock_owner(lock_path(0)) == 1);
+      CHECK(file_system->lock_owner(lock_path(69)) == 1);
+      // The failed attempts left the locks of the other process alone.
+      CHECK(file_system->lock_owner(lock_path(65)) == 2);
+    }
+    accesses.clear();
+    // The locks are released once the accesses are gone.
+    for (size_t i = 0; i < number_of_locks; ++i)
+      CHECK(file_system->lock_owner(lock_path(i)) == (i == 1 || i == 65 ? 2 : 0));
+  }
+
+  // Now every lock can be obtained.
+  std::vector<FileLockAccess> accesses;
+  std::vector<uint64_t> bitmap = FileLockAccess::try_lock(file_lock_ptrs.data(), number_of_locks, accesses);
+  CHECK(bitmap.size() == 2);
+  CHECK(bitmap[0] == ~uint64_t{0});
+  CHECK(bitmap[1] == 0x3f);
+  CHECK(accesses.size() == number_of_locks);
+}
+
+} // namespace
+
+int main()
+{
+  Debug(NAMESPACE_DEBUG::init());
+
+  auto file_system = std::make_shared<FakeFileSystem>();
+  LockDomain ours(std::make_shared<FakeFileLockBackend>(file_system, 1));
+  LockDomain theirs(std::make_shared<FakeFileLockBackend>(file_system, 2));
+
+  test_bitmap(file_system, ours, theirs);
+}